@@ -19,15 +19,31 @@
 
 */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <curses.h>
+#include <dirent.h>
 #include <errno.h>
-#include <menu.h>
-#include <libgen.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <regex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 /*  System utilities */
 #define mensure(x) _mensure(x, __LINE__)
@@ -59,287 +75,5580 @@ static void _ensure(int rc, int line)
 	}
 }
 
-static FILE *spawn_child(int argc, char *argv[])
+/* set_cloexec - keeps a descriptor from leaking into the child or editor. */
+static void set_cloexec(int fd, int nonblock)
+{
+	ensure(fcntl(fd, F_SETFD, FD_CLOEXEC));
+	if (nonblock) {
+		ensure(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+	}
+}
+
+static uint64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* temp_open - opens an unlinked temporary file, or returns -1 */
+static int temp_open()
+{
+	const char *dir = getenv("TMPDIR");
+	char *path;
+	asprintf(&path, "%s/browse.XXXXXX", dir? dir : "/tmp");
+	int fd = mkstemp(mensure(path));
+	if (fd != -1) {
+		unlink(path);
+		set_cloexec(fd, 0);
+	}
+	free(path);
+	return fd;
+}
+
+/* Reactor - the single event loop of the program.  It waits with poll(2) on
+ *   the registered descriptors and on the earliest timer deadline, and
+ *   dispatches to the handlers.  Signals are turned into events through a
+ *   self-pipe, so their handlers run in the loop rather than asynchronously.
+ *   (poll(2) is used rather than epoll(7): there are only a handful of
+ *   descriptors and it works on every platform browse is built on.)
+ */
+#define REACTOR_MAX_SOURCES 256
+#define REACTOR_MAX_TIMERS  8
+typedef void (*reactor_fn)(int fd, void *arg);
+struct reactor_source {
+	int fd;
+	reactor_fn fn;
+	void *arg;
+};
+
+/* struct timer - a one-shot timer owned by the caller, re-armed at will */
+struct timer {
+	uint64_t deadline;                    /* monotonic time in ms, or 0 if disarmed */
+	void (*fn)(struct timer *t);
+};
+
+static struct reactor_source sources[REACTOR_MAX_SOURCES];
+static int sourcec;
+static struct timer *timers[REACTOR_MAX_TIMERS];
+static int timerc;
+static int reactor_running;
+static void (*reactor_idle)();           /* called after each round of events */
+
+static void reactor_add(int fd, reactor_fn fn, void *arg)
+{
+	if (sourcec == REACTOR_MAX_SOURCES) {
+		endwin();
+		fprintf(stderr, "Error: too many event sources\n");
+		exit(EXIT_FAILURE);
+	}
+	sources[sourcec].fd = fd;
+	sources[sourcec].fn = fn;
+	sources[sourcec].arg = arg;
+	++sourcec;
+}
+
+static void reactor_remove(int fd)
+{
+	for (int i = 0; i < sourcec; ++i) {
+		if (sources[i].fd == fd) {
+			sources[i] = sources[--sourcec];
+			return;
+		}
+	}
+}
+
+static void timer_arm(struct timer *t, unsigned ms)
+{
+	int i = 0;
+	while (i < timerc && timers[i] != t) {
+		++i;
+	}
+	if (i == timerc) {
+		if (timerc == REACTOR_MAX_TIMERS) {
+			endwin();
+			fprintf(stderr, "Error: too many timers\n");
+			exit(EXIT_FAILURE);
+		}
+		timers[timerc++] = t;
+	}
+	t->deadline = now_ms() + ms;
+}
+
+static void timer_disarm(struct timer *t)
+{
+	t->deadline = 0;
+}
+
+/* Signals are written to the self-pipe as single bytes. */
+static int signal_pipe[2] = { -1, -1 };
+static void (*signal_fn[NSIG])(int signo);
+
+static void signal_catch(int signo)
+{
+	int saved = errno;
+	unsigned char b = signo;
+	write(signal_pipe[1], &b, 1);
+	errno = saved;
+}
+
+static void signal_dispatch(int fd, void *arg)
+{
+	unsigned char b;
+	while (read(fd, &b, 1) == 1) {
+		if (signal_fn[b]) {
+			signal_fn[b](b);
+		}
+	}
+}
+
+static void reactor_signal(int signo, void (*fn)(int signo))
+{
+	if (signal_pipe[0] == -1) {
+		ensure(pipe(signal_pipe));
+		set_cloexec(signal_pipe[0], 1);
+		set_cloexec(signal_pipe[1], 1);
+		reactor_add(signal_pipe[0], signal_dispatch, NULL);
+	}
+	signal_fn[signo] = fn;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_catch;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	ensure(sigaction(signo, &sa, NULL));
+}
+
+static void reactor_stop()
+{
+	reactor_running = 0;
+}
+
+static void reactor_run()
+{
+	struct pollfd pfd[REACTOR_MAX_SOURCES];
+	for (reactor_running = 1; reactor_running; ) {
+		uint64_t now = now_ms(), next = 0;
+		for (int i = 0; i < timerc; ++i) {
+			if (timers[i]->deadline && (!next || timers[i]->deadline < next)) {
+				next = timers[i]->deadline;
+			}
+		}
+		int timeout = !next? -1 : next <= now? 0 : (int)(next - now);
+		int n = 0;
+		for (int i = 0; i < sourcec; ++i) {
+			pfd[n].fd = sources[i].fd;
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+			++n;
+		}
+		if (poll(pfd, n, timeout) == -1 && errno != EINTR) {
+			endwin();
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < n && reactor_running; ++i) {
+			if (pfd[i].revents == 0) {
+				continue;
+			}
+			/* a handler may have removed the source in the meantime */
+			for (int k = 0; k < sourcec; ++k) {
+				if (sources[k].fd == pfd[i].fd) {
+					sources[k].fn(sources[k].fd, sources[k].arg);
+					break;
+				}
+			}
+		}
+		now = now_ms();
+		for (int i = 0; i < timerc && reactor_running; ++i) {
+			struct timer *t = timers[i];
+			if (t->deadline && t->deadline <= now) {
+				t->deadline = 0;
+				t->fn(t);
+			}
+		}
+		if (reactor_idle && reactor_running) {
+			reactor_idle();
+		}
+	}
+}
+
+/* Error log - the standard error of the child is collected here instead of
+ *   scribbling over the screen.  Only the last ERRLOG_LINES lines are kept,
+ *   truncated to ERRLOG_LINE_LEN.
+ */
+#define ERRLOG_LINES    64
+#define ERRLOG_LINE_LEN 160
+static char errlog[ERRLOG_LINES][ERRLOG_LINE_LEN];
+static size_t errlog_count;               /* number of lines received */
+
+/* errlog_line - returns the n-th most recent line (0 is the last one) */
+static const char *errlog_line(size_t n)
+{
+	return errlog[(errlog_count - 1 - n) % ERRLOG_LINES];
+}
+
+/* struct child - the program whose output is browsed.
+ *   The child runs in its own process group so that it can be killed along
+ *   with everything it started.  Its output is read by a thread of its own
+ *   (see Ingestion) and split into lines in buf; a line longer than the
+ *   buffer is truncated.  Its standard error goes to the error log through a
+ *   pipe of its own.
+ */
+#define CHILD_BUF_LEN (64 << 10)
+struct child {
+	char **argv;
+	pid_t pid;
+	int out;                              /* read end of the stdout pipe, -1 at EOF */
+	int err;                              /* read end of the stderr pipe, -1 at EOF */
+	int pidfd;                            /* readable once the child exits, or -1 */
+	int exited;
+	int status;
+	size_t len;
+	int skip;                             /* discarding the rest of an overlong line */
+	char *line;                           /* partial line: buf, or in the spool */
+	char *line_end;                       /* end of the room claimed in the spool */
+	char buf[CHILD_BUF_LEN];
+	size_t errlen;
+	char errline[ERRLOG_LINE_LEN];        /* partial line of the standard error */
+	pthread_t reader;
+	int reading;                          /* the reader thread is to be joined */
+	struct ring *ring;
+	struct batch *batch;                  /* being filled by the reader, or NULL */
+};
+
+/* errlog_read - appends the complete lines of the standard error to the log.
+ *   Returns the number of lines added, or -1 at the end of the stream.
+ */
+static int errlog_read(struct child *c)
+{
+	char buf[4096];
+	ssize_t n = read(c->err, buf, sizeof(buf));
+	if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+		return 0;
+	}
+	if (n <= 0) {
+		if (c->errlen == 0) {
+			return -1;
+		}
+		buf[0] = '\n';                   /* terminate the last line */
+		n = 1;
+	}
+	int lines = 0;
+	for (ssize_t i = 0; i < n; ++i) {
+		int ch = (unsigned char)buf[i];
+		if (ch == '\n') {
+			c->errline[c->errlen] = '\0';
+			memcpy(errlog[errlog_count++ % ERRLOG_LINES], c->errline, c->errlen + 1);
+			c->errlen = 0;
+			++lines;
+		} else if (c->errlen < ERRLOG_LINE_LEN - 1) {
+			c->errline[c->errlen++] = isprint(ch)? ch : ' ';
+		}
+	}
+	return lines;
+}
+
+/* open_pidfd - returns a descriptor which polls readable once the process
+ *   has exited, or -1 where pidfd_open(2) is not available.
+ */
+static int open_pidfd(pid_t pid)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+	int fd = syscall(SYS_pidfd_open, pid, 0);
+	if (fd != -1) {
+		set_cloexec(fd, 0);
+	}
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+/* Unreaped children - the children, running or cancelled, which were not
+ *   waited for yet.  Only these are reaped, so that the exit status of any
+ *   other child (e.g. the editor) is left to whoever started it.
+ */
+static pid_t *unreaped;
+static size_t unreapedc, unreapeda;
+
+static void unreaped_add(pid_t pid)
+{
+	if (unreapedc == unreapeda) {
+		unreapeda = unreapeda? 2 * unreapeda : 16;
+		unreaped = mensure(realloc(unreaped, unreapeda * sizeof(pid_t)));
+	}
+	unreaped[unreapedc++] = pid;
+}
+
+static void unreaped_forget(pid_t pid)
+{
+	for (size_t i = 0; i < unreapedc; ++i) {
+		if (unreaped[i] == pid) {
+			unreaped[i] = unreaped[--unreapedc];
+			return;
+		}
+	}
+}
+
+/* spawn_child - starts the program with its output connected to a pipe, or
+ *   to a pseudo-terminal.  On a terminal stdio flushes every line instead of
+ *   every 4 KiB, at the price of the colors and the raw mode settings the
+ *   program may apply.
+ */
+static void spawn_child(struct child *c, char *argv[], int pty)
 {
-	FILE *fp = NULL;
-	int fd[2];
-	pipe(fd);
+	int fd[2], err[2];
+	ensure(pipe(err));
+	const char *slave = NULL;
+	if (pty) {
+		ensure(fd[0] = posix_openpt(O_RDWR | O_NOCTTY));
+		ensure(grantpt(fd[0]));
+		ensure(unlockpt(fd[0]));
+		slave = ptsname(fd[0]);
+		ensure(slave? 0 : -1);
+		fd[1] = -1;
+	} else {
+		ensure(pipe(fd));
+	}
 	pid_t pid = fork();
 	if (pid == -1) {
 		perror("fork");
 		exit(EXIT_FAILURE);
 	} else if (pid == 0) {
 		/* child */
+		if (pty) {
+			struct termios t;
+			ensure(setsid());
+			ensure(fd[1] = open(slave, O_RDWR));
+			if (tcgetattr(fd[1], &t) == 0) {
+				cfmakeraw(&t);
+				tcsetattr(fd[1], TCSANOW, &t);
+			}
+		} else {
+			setpgid(0, 0);
+		}
+		int null = open("/dev/null", O_RDONLY);
+		ensure(null);
+		ensure(dup2(null, STDIN_FILENO));
+		ensure(close(err[0]));
+		ensure(dup2(err[1], STDERR_FILENO));
+		ensure(close(err[1]));
 		ensure(close(fd[0]));
 		ensure(dup2(fd[1], STDOUT_FILENO));
 		ensure(close(fd[1]));
-		ensure(execvp(argv[1], argv + 1));
-	} else {
-		/* parent */
+		ensure(execvp(argv[0], argv));
+	}
+	/* parent */
+	if (!pty) {
+		setpgid(pid, pid);
 		close(fd[1]);
-		fp = fdopen(fd[0], "r");
-		if (fp == NULL) {
-			perror("fdopen");
-			exit(EXIT_FAILURE);
-		}
 	}
-	return fp;
+	close(err[1]);
+	set_cloexec(fd[0], 1);
+	set_cloexec(err[0], 1);
+	c->pid = pid;
+	unreaped_add(pid);
+	c->out = fd[0];
+	c->err = err[0];
+	c->errlen = 0;
+	c->pidfd = open_pidfd(pid);
+	c->exited = 0;
+	c->line = c->buf;
+	c->len = 0;
+	c->skip = 0;
 }
 
-/* struct match - represents a single grep match line */
+/* struct match - represents a single grep match line.  The colors the
+ *   program gave the description, if any, are kept as spans of it.
+ */
 #define MATCH_PATH_LEN        256
 #define MATCH_DESCRIPTION_LEN 256
+#define MATCH_SPANS_LEN       6
+#define SPAN_COLOR            0x0f        /* the foreground color + 1, or 0 */
+#define SPAN_BOLD             0x10
+#define SPAN_UNDERLINE        0x20
+#define SPAN_REVERSE          0x40
+struct span {
+	uint8_t from, to;                     /* offsets in the description */
+	uint8_t attr;                         /* SPAN_* */
+};
 struct match {
 	char filepath[MATCH_PATH_LEN];
 	int  line;
-	char *name;
+	uint8_t spanc;
+	struct span spans[MATCH_SPANS_LEN];
 	char description[MATCH_DESCRIPTION_LEN];
 };
 
-/* menu contaning the matches found */
-static ITEM **items;
-static MENU *match_menu;
+/* struct bytes - a growable byte buffer */
+struct bytes {
+	uint8_t *p;
+	size_t len, alloc;
+};
 
-static size_t matchc, matcha;
-static struct match *matchv;
+static void bytes_put(struct bytes *b, const void *data, size_t n)
+{
+	if (b->len + n > b->alloc) {
+		b->alloc = b->alloc? 2 * b->alloc : 4096;
+		while (b->alloc < b->len + n) {
+			b->alloc *= 2;
+		}
+		b->p = mensure(realloc(b->p, b->alloc));
+	}
+	memcpy(b->p + b->len, data, n);
+	b->len += n;
+}
 
-#define MATCH_CHUNK_LEN 32
-static void resize_matchv()
+static void bytes_varint(struct bytes *b, uint64_t v)
 {
-	if (matchc == matcha) {
-		matcha += MATCH_CHUNK_LEN;
-		matchv = mensure(realloc(matchv, matcha * sizeof(struct match)));
+	uint8_t buf[10];
+	size_t n = 0;
+	for ( ; v >= 0x80; v >>= 7) {
+		buf[n++] = (v & 0x7f) | 0x80;
 	}
+	buf[n++] = v;
+	bytes_put(b, buf, n);
 }
 
-static void init_matchv()
+static uint64_t get_varint(const uint8_t **p)
 {
-	matchc = matcha = 0;
-	matchv = NULL;
-	resize_matchv();
+	uint64_t v = 0;
+	for (unsigned shift = 0; ; shift += 7) {
+		uint8_t b = *(*p)++;
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			return v;
+		}
+	}
 }
 
-static void open_match(const struct match *m)
+static uint64_t zigzag(int64_t v)
 {
-	char *command;
-	asprintf(&command, "%s +%u %s", editor, m->line, m->filepath);
-	system(command);
-	free(command);
+	return (uint64_t)v << 1 ^ (uint64_t)(v >> 63);
 }
 
-/* parse_next_match - reads the next line from the stream and parses it.
- *   This function expects a line as produced by grep -n, i.e.:
- *      <filename>:<linenumber>:<matchtext>
- *   The maximum length for each buffer is observed.
- *   Non-printable characters are replaced.
- *   Returns 0 on success, -1 (or EOF), or 1 if the record could not be parsed.
- */
-#define SEPARATOR     ':'
-#define TAB_REPL      ' '
-#define TAB_STOP      4
-#define NONPRINT_REPL '.'
-static int parse_next_match(FILE *fp, struct match* m)
+static int64_t unzigzag(uint64_t v)
 {
-	char line_num_buf[32];
-	char *buffer = m->filepath;
-	size_t buffer_avail = sizeof(m->filepath);
-	int ch = fgetc(fp);
-	int state = 0;
-	for ( ; ch != EOF; ch = fgetc(fp)) {
-		int appendcount = 0;
-		if (ch == SEPARATOR) {
-			/* state transition: switch buffers */
-			if (state == 0) {
-				*buffer = '\0';
-				buffer = line_num_buf;
-				buffer_avail = sizeof(line_num_buf);
-				*buffer = '\0';
-				++state;
-			} else if (state == 1) {
-				*buffer = '\0';
-				buffer = m->description;
-				buffer_avail = sizeof(m->description);
-				*buffer = '\0';
-				++state;
-			} else {
-				appendcount = 1;
-			}
-		} else if (ch == '\n') {
-			*buffer = '\0';
-			break;
-		} else if (!isprint(ch)) {
-			if (ch == '\t') {
-				ch = TAB_REPL;
-				appendcount = TAB_STOP;
-			} else {
-				ch = NONPRINT_REPL;
-				appendcount = 1;
-			}
-		} else {
-			appendcount = 1;
-		}
-		for (unsigned i = 0; i < appendcount; ++i) {
-			if (!buffer_avail) {
-				continue;
-			} else if (--buffer_avail == 0) {
-				*buffer++ = '\0';
-			} else {
-				*buffer++ = ch;
-			}
-		}
-	}
-	if (state == 2) {
-		m->line = atoi(line_num_buf);
-		return ch == EOF? EOF : 0;
-	}
-	return ch == EOF? EOF : 1;
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
 }
 
-/* Curses functions */
-#define MATCH_COLOR_FG 1
-#define MATCH_COLOR_BG 2
-#define FOOTER_COLORS  3
-static void init_curses()
+/* LZ compression - a byte-oriented LZ77 codec in the spirit of LZ4.
+ *   A sequence is a token (the number of literals in the high nibble, the
+ *   match length minus LZ_MIN_MATCH in the low one, 15 meaning that more
+ *   length bytes follow), the literals, and the 16-bit offset of the match.
+ *   The last sequence has literals only.
+ */
+#define LZ_MIN_MATCH  4
+#define LZ_HASH_BITS  12
+#define LZ_MAX_OFFSET 65535
+
+static size_t lz_bound(size_t n)
 {
-	initscr();
-	keypad(stdscr, TRUE);
-	cbreak();
-	noecho();
-	start_color();
-	init_pair(MATCH_COLOR_FG, COLOR_WHITE, COLOR_BLUE);
-	init_pair(MATCH_COLOR_BG, COLOR_WHITE, COLOR_BLACK);
-	init_pair(FOOTER_COLORS,  COLOR_WHITE, COLOR_GREEN);
+	return n + n / 255 + 16;
 }
 
-static void cleanup_curses()
+static uint8_t *lz_put_len(uint8_t *op, size_t n)
 {
-	endwin();
-	unpost_menu(match_menu);
-	for (size_t i = 0; i < matchc; ++i) {
-		free(matchv[i].name);
-		free_item(items[i]);
+	for (n -= 15; n >= 255; n -= 255) {
+		*op++ = 255;
 	}
-	free_menu(match_menu);
-	free(items);
-	free(matchv);
+	*op++ = n;
+	return op;
 }
 
-/* View functions */
-#define EXIT_HINT     "Hit 'q' to exit  "
-#define EXIT_HINT_LEN (sizeof(EXIT_HINT) - 1)
-static void display_footer(size_t match_count)
+static size_t lz_compress(const uint8_t *in, size_t n, uint8_t *out)
 {
-	char footer[COLS + 1];
-	int len = snprintf(footer, sizeof(footer), "%zu matches", match_count);
-	if (len < 1) {
-		return;
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+	const uint8_t *ip = in, *anchor = in, *end = in + n;
+	uint8_t *op = out;
+	while (ip + LZ_MIN_MATCH <= end) {
+		uint32_t v;
+		memcpy(&v, ip, sizeof(v));
+		uint32_t h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+		const uint8_t *ref = in + table[h];
+		table[h] = ip - in;
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+			++ip;
+			continue;
+		}
+		size_t len = LZ_MIN_MATCH, lit = ip - anchor;
+		while (ip + len < end && ref[len] == ip[len]) {
+			++len;
+		}
+		uint8_t *token = op++;
+		*token = (lit < 15? lit : 15) << 4 | (len - LZ_MIN_MATCH < 15? len - LZ_MIN_MATCH : 15);
+		if (lit >= 15) {
+			op = lz_put_len(op, lit);
+		}
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		if (len - LZ_MIN_MATCH >= 15) {
+			op = lz_put_len(op, len - LZ_MIN_MATCH);
+		}
+		ip += len;
+		anchor = ip;
 	}
-	int l = COLS - len - EXIT_HINT_LEN;
-	if (l < 0) {
-		return;
+	size_t lit = end - anchor;
+	*op++ = (lit < 15? lit : 15) << 4;
+	if (lit >= 15) {
+		op = lz_put_len(op, lit);
 	}
-	memset(footer + len, ' ', l);
-	memcpy(footer + len + l, EXIT_HINT, EXIT_HINT_LEN);
-	footer[COLS] = '\0';
-	attron(COLOR_PAIR(FOOTER_COLORS) | A_BOLD);
-	mvprintw(LINES - 1, 0, "%s", footer);
-	attroff(COLOR_PAIR(FOOTER_COLORS));
+	memcpy(op, anchor, lit);
+	return op + lit - out;
 }
 
-#define MENU_MARK ">"
-static void build_menu(FILE *fp)
+static void lz_decompress(const uint8_t *in, size_t n, uint8_t *out)
 {
-	/* parse menu contents */
-	int rc;
-	for (init_matchv(); (rc = parse_next_match(fp, &matchv[matchc])) != EOF; resize_matchv()) {
-		matchc += (rc == 0)? 1 : 0;
-	}
-	if (matchc == 0) {
-		free(matchv);
-		int status;
-		if (wait(&status) == -1) {
-			perror("Cannot read child process exit status");
-			exit(EXIT_FAILURE);
+	const uint8_t *ip = in, *end = in + n;
+	uint8_t *op = out;
+	while (ip < end) {
+		unsigned token = *ip++;
+		size_t lit = token >> 4, len = token & 15;
+		if (lit == 15) {
+			do {
+				lit += *ip;
+			} while (*ip++ == 255);
+		}
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip >= end) {
+			break;
 		}
-		if (WEXITSTATUS(status) == 0) {
-			fprintf(stderr, "Unable to parse matches. (Did you forget to specify the "
-				"'-n' option to grep?)\n");
-		} else if (WEXITSTATUS(status) == 1) {
-			fprintf(stderr, "No matches.\n");
+		const uint8_t *ref = op - (ip[0] | ip[1] << 8);
+		ip += 2;
+		if (len == 15) {
+			do {
+				len += *ip;
+			} while (*ip++ == 255);
+		}
+		for (len += LZ_MIN_MATCH; len; --len) {
+			*op++ = *ref++;
 		}
-		exit(WEXITSTATUS(status));
-	}
-	items = mensure(malloc((matchc + 1) * sizeof(ITEM*)));
-	for (size_t i = 0; i < matchc; ++i) {
-		asprintf(&matchv[i].name, "%s [%d]", basename(matchv[i].filepath), matchv[i].line);
-		items[i] = mensure(new_item(matchv[i].name, matchv[i].description));
-		set_item_userptr(items[i], &matchv[i]);
 	}
-	items[matchc] = NULL;
+}
 
-	/* build curses menu */
-	init_curses();
-	match_menu = mensure(new_menu(items));
-	set_menu_fore(match_menu, COLOR_PAIR(MATCH_COLOR_FG) | A_BOLD);
-	set_menu_back(match_menu, COLOR_PAIR(MATCH_COLOR_BG));
-	set_menu_mark(match_menu, MENU_MARK);
-	set_menu_format(match_menu, LINES - 1, 1);
-	display_footer(matchc);
-	post_menu(match_menu);
-	refresh();
+/* Slot tables - open-addressing hash tables from a 64-bit hash to the id of
+ *   an interned item, for the paths, the files to sort and the directory
+ *   trie.  As items may share a hash, a lookup is given a function telling
+ *   whether the item with an id is the one sought, unless the hash is the
+ *   item itself.
+ */
+struct slot {
+	uint64_t hash;
+	uint32_t id;                          /* id + 1, or 0 if free */
+};
+struct slot_table {
+	struct slot *slots;
+	size_t len, used;
+};
+#define SLOT_NONE UINT32_MAX
+
+static size_t slot_index(uint64_t hash, size_t len)
+{
+	hash *= 0x9e3779b97f4a7c15u;
+	return (hash ^ hash >> 32) & (len - 1);
 }
 
-#define ENTER  10
-#define ESCAPE 27
-static void event_loop()
+/* slot_find - returns the id of an item, or SLOT_NONE */
+static uint32_t slot_find(const struct slot_table *t, uint64_t hash,
+	int (*is)(uint32_t id, const char *name), const char *name)
 {
-	for (int c = 1; c; ) {
-		switch(c = getch()) {
-		case 'j':
-		case KEY_DOWN:
-			menu_driver(match_menu, REQ_DOWN_ITEM);
-			break;
-		case 'k':
-		case KEY_UP:
-			menu_driver(match_menu, REQ_UP_ITEM);
-			break;
-		case KEY_NPAGE:
-			menu_driver(match_menu, REQ_SCR_DPAGE);
-			break;
-		case KEY_PPAGE:
-			menu_driver(match_menu, REQ_SCR_UPAGE);
-			break;
-		case ENTER: {
-			endwin();
-			struct match *entry = (struct match *)item_userptr(current_item(match_menu));
-			if (entry == NULL) {
-				cleanup_curses();
-				fprintf(stderr, "Error: internal error: no entry associated with "
-					"match\n");
-				exit(EXIT_FAILURE);
-			}
-			open_match(entry);
-			refresh();
-			pos_menu_cursor(match_menu);
-			break;
-		}
-		case ESCAPE:
-		case 'q':
-			c = 0;
-			break;
+	if (t->len == 0) {
+		return SLOT_NONE;
+	}
+	for (size_t i = slot_index(hash, t->len); t->slots[i].id; i = (i + 1) & (t->len - 1)) {
+		if (t->slots[i].hash == hash && (is == NULL || is(t->slots[i].id - 1, name))) {
+			return t->slots[i].id - 1;
 		}
 	}
-	cleanup_curses();
+	return SLOT_NONE;
 }
 
-/* Program entry point */
-int main(int argc, char *argv[])
+static void slot_insert(struct slot *slots, size_t len, uint64_t hash, uint32_t id)
 {
-	if (argc < 2) {
-		fprintf(stderr, "Usage: %s <program> [ args ... ]\n", *argv);
-		exit(2);
+	size_t i = slot_index(hash, len);
+	while (slots[i].id) {
+		i = (i + 1) & (len - 1);
 	}
-	seteditor();
-	build_menu(spawn_child(argc, argv));
+	slots[i].hash = hash;
+	slots[i].id = id + 1;
+}
+
+/* slot_add - adds an item which is not in the table yet */
+static void slot_add(struct slot_table *t, uint64_t hash, uint32_t id)
+{
+	if (2 * (t->used + 1) > t->len) {
+		struct slot *old = t->slots;
+		size_t oldc = t->len;
+		t->len = oldc? 2 * oldc : 1024;
+		t->slots = mensure(calloc(t->len, sizeof(struct slot)));
+		for (size_t k = 0; k < oldc; ++k) {
+			if (old[k].id) {
+				slot_insert(t->slots, t->len, old[k].hash, old[k].id - 1);
+			}
+		}
+		free(old);
+	}
+	slot_insert(t->slots, t->len, hash, id);
+	++t->used;
+}
+
+static void slot_clear(struct slot_table *t)
+{
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+}
+
+/* Path table - interns the file paths of the compact store.  The paths are
+ *   front-coded against the previous one, in groups of PATH_GROUP_LEN which
+ *   start with a full path; an open-addressing hash table of path hashes
+ *   finds the id of a known path.
+ */
+#define PATH_GROUP_LEN 16
+static struct bytes path_data;
+static size_t *path_groups;               /* offset of each group in path_data */
+static size_t pathc;
+static struct slot_table path_slots;
+static char path_last[MATCH_PATH_LEN];    /* the last path added */
+static char path_hit[MATCH_PATH_LEN];     /* the last path looked up ... */
+static uint32_t path_hit_id;              /* ... and its id */
+
+static uint64_t path_hash(const char *path)
+{
+	uint64_t h = 14695981039346656037u;
+	for ( ; *path; ++path) {
+		h = (h ^ (unsigned char)*path) * 1099511628211u;
+	}
+	return h;
+}
+
+static void path_decode(uint32_t id, char *out)
+{
+	const uint8_t *p = path_data.p + path_groups[id / PATH_GROUP_LEN];
+	for (uint32_t k = 0; k <= id % PATH_GROUP_LEN; ++k) {
+		size_t prefix = get_varint(&p), suffix = get_varint(&p);
+		memcpy(out + prefix, p, suffix);
+		out[prefix + suffix] = '\0';
+		p += suffix;
+	}
+}
+
+static int path_is(uint32_t id, const char *path)
+{
+	char buf[MATCH_PATH_LEN];
+	path_decode(id, buf);
+	return strcmp(buf, path) == 0;
+}
+
+static uint32_t path_intern(const char *path)
+{
+	if (pathc && strcmp(path, path_hit) == 0) {
+		return path_hit_id;
+	}
+	uint64_t hash = path_hash(path);
+	uint32_t found = slot_find(&path_slots, hash, path_is, path);
+	if (found != SLOT_NONE) {
+		strcpy(path_hit, path);
+		return path_hit_id = found;
+	}
+	uint32_t id = pathc++;
+	size_t prefix = 0, len = strlen(path);
+	if (id % PATH_GROUP_LEN == 0) {
+		path_groups = mensure(realloc(path_groups,
+			(id / PATH_GROUP_LEN + 1) * sizeof(size_t)));
+		path_groups[id / PATH_GROUP_LEN] = path_data.len;
+	} else {
+		while (path[prefix] && path[prefix] == path_last[prefix]) {
+			++prefix;
+		}
+	}
+	bytes_varint(&path_data, prefix);
+	bytes_varint(&path_data, len - prefix);
+	bytes_put(&path_data, path + prefix, len - prefix);
+	strcpy(path_last, path);
+	slot_add(&path_slots, hash, id);
+	strcpy(path_hit, path);
+	return path_hit_id = id;
+}
+
+/* Compact store - with -c, the matches are kept in blocks of
+ *   COMPACT_BLOCK_LEN, each holding a record per match (the delta to the file
+ *   id of the previous match, the delta to the previous line in the same
+ *   file, the length of the description and its spans), followed by the descriptions
+ *   of the block compressed together.  The block being filled is kept as
+ *   is; the others are decoded on demand, i.e. for the visible rows, into a
+ *   small cache of decoded blocks.
+ */
+#define COMPACT_BLOCK_LEN 128
+#define COMPACT_CACHE_LEN 8
+struct cblock {
+	uint8_t *data;                        /* records, then the descriptions */
+	uint32_t reclen, desclen, rawlen;
+};
+struct cblock_cache {
+	size_t block;
+	unsigned stamp;                       /* 0 if unused */
+	struct match v[COMPACT_BLOCK_LEN];
+};
+static int match_compact;
+static struct cblock *cblocks;
+static size_t cblockc, cblocka;
+static struct match compact_tail[COMPACT_BLOCK_LEN];
+static uint32_t compact_tail_file[COMPACT_BLOCK_LEN];
+static size_t compact_tailc;
+static struct cblock_cache compact_cache[COMPACT_CACHE_LEN];
+static unsigned compact_stamp;
+
+static void compact_seal()
+{
+	static uint8_t raw[COMPACT_BLOCK_LEN * MATCH_DESCRIPTION_LEN];
+	struct bytes rec = { NULL, 0, 0 };
+	size_t rawlen = 0;
+	uint32_t file = 0;
+	int line = 0;
+	for (size_t i = 0; i < compact_tailc; ++i) {
+		const struct match *m = &compact_tail[i];
+		size_t len = strlen(m->description);
+		if (compact_tail_file[i] != file) {
+			line = 0;
+		}
+		bytes_varint(&rec, zigzag((int64_t)compact_tail_file[i] - file));
+		bytes_varint(&rec, zigzag((int64_t)m->line - line));
+		bytes_varint(&rec, len);
+		bytes_varint(&rec, m->spanc);
+		bytes_put(&rec, m->spans, m->spanc * sizeof(struct span));
+		memcpy(raw + rawlen, m->description, len);
+		rawlen += len;
+		file = compact_tail_file[i];
+		line = m->line;
+	}
+	if (cblockc == cblocka) {
+		cblocka = cblocka? 2 * cblocka : 256;
+		cblocks = mensure(realloc(cblocks, cblocka * sizeof(struct cblock)));
+	}
+	struct cblock *b = &cblocks[cblockc++];
+	b->data = mensure(malloc(rec.len + lz_bound(rawlen)));
+	memcpy(b->data, rec.p, rec.len);
+	b->reclen = rec.len;
+	b->rawlen = rawlen;
+	b->desclen = lz_compress(raw, rawlen, b->data + rec.len);
+	b->data = mensure(realloc(b->data, b->reclen + b->desclen));
+	free(rec.p);
+	compact_tailc = 0;
+}
+
+/* compact_commit - adds the match parsed into the next slot of the block
+ *   being filled, which is where match_new points in compact mode.
+ */
+static void compact_commit()
+{
+	compact_tail_file[compact_tailc] = path_intern(compact_tail[compact_tailc].filepath);
+	if (++compact_tailc == COMPACT_BLOCK_LEN) {
+		compact_seal();
+	}
+}
+
+static void compact_decode(size_t block, struct match *v)
+{
+	uint8_t raw[COMPACT_BLOCK_LEN * MATCH_DESCRIPTION_LEN];
+	const struct cblock *b = &cblocks[block];
+	const uint8_t *p = b->data, *desc = raw;
+	lz_decompress(b->data + b->reclen, b->desclen, raw);
+	uint32_t file = 0;
+	int line = 0;
+	for (size_t i = 0; i < COMPACT_BLOCK_LEN; ++i) {
+		uint32_t f = file + unzigzag(get_varint(&p));
+		if (f != file) {
+			line = 0;
+		}
+		if (i > 0 && f == file) {
+			strcpy(v[i].filepath, v[i - 1].filepath);
+		} else {
+			path_decode(f, v[i].filepath);
+		}
+		v[i].line = line += unzigzag(get_varint(&p));
+		size_t len = get_varint(&p);
+		v[i].spanc = get_varint(&p);
+		memcpy(v[i].spans, p, v[i].spanc * sizeof(struct span));
+		p += v[i].spanc * sizeof(struct span);
+		memcpy(v[i].description, desc, len);
+		v[i].description[len] = '\0';
+		desc += len;
+		file = f;
+	}
+}
+
+static struct match *compact_at(size_t i)
+{
+	size_t block = i / COMPACT_BLOCK_LEN;
+	if (block == cblockc) {
+		return &compact_tail[i % COMPACT_BLOCK_LEN];
+	}
+	struct cblock_cache *c = &compact_cache[0];
+	for (int k = 0; k < COMPACT_CACHE_LEN; ++k) {
+		struct cblock_cache *e = &compact_cache[k];
+		if (e->stamp && e->block == block) {
+			c = e;
+			break;
+		} else if (e->stamp < c->stamp) {
+			c = e;
+		}
+	}
+	if (!c->stamp || c->block != block) {
+		compact_decode(block, c->v);
+		c->block = block;
+	}
+	c->stamp = ++compact_stamp;
+	return &c->v[i % COMPACT_BLOCK_LEN];
+}
+
+static void compact_clear()
+{
+	for (size_t b = 0; b < cblockc; ++b) {
+		free(cblocks[b].data);
+	}
+	cblockc = compact_tailc = pathc = 0;
+	path_data.len = 0;
+	slot_clear(&path_slots);
+	memset(compact_cache, 0, sizeof(compact_cache));
+}
+
+/* Spool - with -s, the output of the children goes straight into an
+ *   unlinked temporary file, mapped at the end of a reserved address range
+ *   as it grows, and the matches only keep the offsets of their lines.  The
+ *   children read into the mapping (on Linux, pipes are spliced into the
+ *   file without going through user space at all), and the lines are only
+ *   parsed again when they are looked at, into a small cache of matches.
+ */
+#define SPOOL_MAX        ((size_t)1 << (sizeof(void *) > 4? 36 : 29))
+#define SPOOL_CHUNK      ((size_t)16 << 20)
+#define SPOOL_RECS_LEN   4096
+#define SPOOL_MAX_RECS   (1 << 16)
+#define SPOOL_CACHE_LEN  1024
+struct spool_rec {
+	uint64_t off;
+	uint32_t len;
+};
+struct spool_slot {
+	size_t tag;                           /* index + 1 of the match, or 0 */
+	struct match m;
+};
+static int match_spool;
+static int spool_fd = -1;
+static char *spool_base;
+static size_t spool_len, spool_mapped;
+static pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct spool_rec *spool_recs[SPOOL_MAX_RECS];
+static struct spool_slot spool_cache[SPOOL_CACHE_LEN];
+
+static void spool_open()
+{
+	void *p = mmap(NULL, SPOOL_MAX, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	spool_base = mensure(p == MAP_FAILED? NULL : p);
+	ensure(spool_fd = temp_open());
+}
+
+/* spool_room - returns where the next n bytes go at the end of the spool */
+static char *spool_room(size_t n)
+{
+	while (spool_len + n > spool_mapped) {
+		if (spool_mapped + SPOOL_CHUNK > SPOOL_MAX) {
+			endwin();
+			fprintf(stderr, "Error: the output is too large\n");
+			exit(EXIT_FAILURE);
+		}
+		ensure(ftruncate(spool_fd, spool_mapped + SPOOL_CHUNK));
+		void *p = mmap(spool_base + spool_mapped, SPOOL_CHUNK, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, spool_fd, spool_mapped);
+		mensure(p == MAP_FAILED? NULL : p);
+		spool_mapped += SPOOL_CHUNK;
+	}
+	return spool_base + spool_len;
+}
+
+/* spool_read - reads from fd into the room of a reader in the spool at p */
+static ssize_t spool_read(int fd, char *p, size_t n)
+{
+#ifdef SPLICE_F_MOVE
+	static int nosplice;
+	if (!__atomic_load_n(&nosplice, __ATOMIC_RELAXED)) {
+		loff_t off = p - spool_base;
+		ssize_t r = splice(fd, NULL, spool_fd, &off, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (r != -1 || errno != EINVAL) {
+			return r;
+		}
+		__atomic_store_n(&nosplice, 1, __ATOMIC_RELAXED);    /* not a pipe, e.g. a pty */
+	}
+#endif
+	return read(fd, p, n);
+}
+
+/* spool_claim - reserves n bytes at the end of the spool for a reader */
+static char *spool_claim(size_t n)
+{
+	pthread_mutex_lock(&spool_lock);
+	char *p = spool_room(n);
+	spool_len += n;
+	pthread_mutex_unlock(&spool_lock);
+	return p;
+}
+
+static void spool_commit(size_t i, const struct spool_rec *r)
+{
+	struct spool_rec **b = &spool_recs[i / SPOOL_RECS_LEN];
+	if (*b == NULL) {
+		if (i / SPOOL_RECS_LEN + 1 == SPOOL_MAX_RECS) {
+			endwin();
+			fprintf(stderr, "Error: too many matches\n");
+			exit(EXIT_FAILURE);
+		}
+		*b = mensure(malloc(SPOOL_RECS_LEN * sizeof(struct spool_rec)));
+	}
+	(*b)[i % SPOOL_RECS_LEN] = *r;
+	spool_cache[i % SPOOL_CACHE_LEN].tag = 0;
+}
+
+static int parse_match(const char *s, size_t n, struct match *m);
+
+static struct match *spool_at(size_t i)
+{
+	struct spool_slot *slot = &spool_cache[i % SPOOL_CACHE_LEN];
+	if (slot->tag != i + 1) {
+		const struct spool_rec *r = &spool_recs[i / SPOOL_RECS_LEN][i % SPOOL_RECS_LEN];
+		parse_match(spool_base + r->off, r->len, &slot->m);
+		slot->tag = i + 1;
+	}
+	return &slot->m;
+}
+
+static void spool_clear()
+{
+	spool_len = 0;
+	memset(spool_cache, 0, sizeof(spool_cache));
+}
+
+/* Match store - unless compact or spooled (see above), the matches are kept
+ *   in blocks of MATCH_BLOCK_LEN, which never move once allocated.  With a
+ *   memory budget, the oldest full blocks beyond it are written to an
+ *   unlinked temporary file, and the file is mapped in their place at the
+ *   same address: the kernel can then drop their pages at will and read
+ *   them back when they are looked at.
+ */
+#define MATCH_BLOCK_LEN   2048
+#define MATCH_BLOCK_BYTES (MATCH_BLOCK_LEN * sizeof(struct match))
+#define MATCH_MAX_BLOCKS  (1 << 16)
+static struct match *match_blocks[MATCH_MAX_BLOCKS];
+static size_t matchc;
+static size_t match_budget;               /* bytes of resident blocks, 0 if unlimited */
+static size_t match_spilled;              /* blocks written to the spill file */
+static int spill_fd = -1;
+
+static struct match *match_at(size_t i)
+{
+	if (match_compact) {
+		return compact_at(i);
+	} else if (match_spool) {
+		return spool_at(i);
+	}
+	return &match_blocks[i / MATCH_BLOCK_LEN][i % MATCH_BLOCK_LEN];
+}
+
+/* spill_block - moves a full block to the spill file.  On failure the block
+ *   stays in memory, and so will the next ones.
+ */
+static int spill_block(size_t b)
+{
+	if (spill_fd == -1 && (spill_fd = temp_open()) == -1) {
+		return -1;
+	}
+	const char *p = (const char *)match_blocks[b];
+	off_t off = (off_t)b * MATCH_BLOCK_BYTES;
+	for (size_t done = 0; done < MATCH_BLOCK_BYTES; ) {
+		ssize_t n = pwrite(spill_fd, p + done, MATCH_BLOCK_BYTES - done, off + done);
+		if (n == 0 || (n < 0 && errno != EINTR)) {
+			return -1;
+		}
+		done += n > 0? n : 0;
+	}
+	if (mmap(match_blocks[b], MATCH_BLOCK_BYTES, PROT_READ, MAP_SHARED | MAP_FIXED,
+		spill_fd, off) == MAP_FAILED) {
+		return -1;
+	}
+	return 0;
+}
+
+/* match_new - returns the slot for the next match, allocating its block */
+static struct match *match_new()
+{
+	if (match_compact) {
+		return &compact_tail[compact_tailc];
+	}
+	size_t b = matchc / MATCH_BLOCK_LEN;
+	if (match_blocks[b] == NULL) {
+		if (b + 1 == MATCH_MAX_BLOCKS) {
+			endwin();
+			fprintf(stderr, "Error: too many matches\n");
+			exit(EXIT_FAILURE);
+		}
+		void *p = mmap(NULL, MATCH_BLOCK_BYTES, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANON, -1, 0);
+		match_blocks[b] = mensure(p == MAP_FAILED? NULL : p);
+		while (match_budget && (b + 1 - match_spilled) * MATCH_BLOCK_BYTES > match_budget
+			&& match_spilled < b) {
+			if (spill_block(match_spilled) == -1) {
+				match_budget = 0;
+				break;
+			}
+			++match_spilled;
+		}
+	}
+	return match_at(matchc);
+}
+
+static void matches_clear()
+{
+	compact_clear();
+	spool_clear();
+	for (size_t b = 0; b < MATCH_MAX_BLOCKS && match_blocks[b]; ++b) {
+		munmap(match_blocks[b], MATCH_BLOCK_BYTES);
+		match_blocks[b] = NULL;
+	}
+	if (spill_fd != -1) {
+		ftruncate(spill_fd, 0);
+	}
+	matchc = match_spilled = 0;
+}
+
+/* struct mreader - reads matches on any thread, as long as the main thread
+ *   does not add any meanwhile.  Unlike match_at(), it decodes the compact
+ *   store and parses the spool into buffers of its own rather than into the
+ *   shared caches.
+ */
+struct mreader {
+	size_t block;                         /* decoded in v, plus one */
+	struct match *v;
+	struct match m;
+};
+#define MREADER_INIT { 0, NULL }
+
+static const struct match *mreader_at(struct mreader *r, size_t i)
+{
+	if (match_compact) {
+		size_t block = i / COMPACT_BLOCK_LEN;
+		if (block == cblockc) {
+			return &compact_tail[i % COMPACT_BLOCK_LEN];
+		}
+		if (r->v == NULL) {
+			r->v = mensure(malloc(COMPACT_BLOCK_LEN * sizeof(struct match)));
+		}
+		if (r->block != block + 1) {
+			compact_decode(block, r->v);
+			r->block = block + 1;
+		}
+		return &r->v[i % COMPACT_BLOCK_LEN];
+	} else if (match_spool) {
+		const struct spool_rec *rec = &spool_recs[i / SPOOL_RECS_LEN][i % SPOOL_RECS_LEN];
+		parse_match(spool_base + rec->off, rec->len, &r->m);
+		return &r->m;
+	}
+	return &match_blocks[i / MATCH_BLOCK_LEN][i % MATCH_BLOCK_LEN];
+}
+
+static void mreader_free(struct mreader *r)
+{
+	free(r->v);
+}
+
+/* Backpressure - with a read-ahead, the children are no longer read once
+ *   the list holds that many rows past the last visible one.  They block on
+ *   the full pipe until the view moves closer to the end.
+ */
+static size_t read_ahead;                 /* 0 if unlimited */
+static int read_all;                      /* lifts the read-ahead for this run */
+static int reading_paused;
+
+static void open_match(const struct match *m)
+{
+	char *command;
+	asprintf(&command, "%s +%u %s", editor, m->line, m->filepath);
+	system(command);
+	free(command);
+}
+
+/* Line index - maps line numbers to byte offsets in constant time.
+ *   Lines are grouped in blocks of LINEIDX_BLOCK; the absolute offset is only
+ *   stored for the first line of each block, the other lines store a 16-bit
+ *   offset relative to it.  Blocks spanning 64 KiB or more (i.e. with very
+ *   long lines) store 32-bit relative offsets in a separate table instead.
+ */
+#define LINEIDX_BLOCK 64
+struct lineidx_block {
+	size_t base;                          /* offset of the first line */
+	uint32_t wide;                        /* 1-based slot in the wide table, or 0 */
+};
+struct lineidx {
+	size_t lines;
+	struct lineidx_block *block;
+	uint16_t *delta;
+	uint32_t *wide;
+};
+
+static void lineidx_free(struct lineidx *ix)
+{
+	free(ix->block);
+	free(ix->delta);
+	free(ix->wide);
+	free(ix);
+}
+
+/* lineidx_build - indexes the given buffer with a single memchr() pass.
+ *   Returns NULL if *cancel (when given) is set meanwhile.
+ */
+static struct lineidx *lineidx_build(const char *base, size_t size, size_t *bytes,
+	const int *cancel)
+{
+	struct lineidx *ix = mensure(calloc(1, sizeof(struct lineidx)));
+	size_t blocka = 0, lines = 0, widec = 0;
+	size_t offset[LINEIDX_BLOCK];
+	const char *p = base, *end = base + size;
+	while (p != NULL) {
+		if (cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED)) {
+			lineidx_free(ix);
+			return NULL;
+		}
+		size_t k = 0;
+		for ( ; p != NULL && k < LINEIDX_BLOCK; ++k) {
+			offset[k] = p - base;
+			p = memchr(p, '\n', end - p);
+			p = (p && p + 1 < end)? p + 1 : NULL;
+		}
+		size_t b = lines / LINEIDX_BLOCK;
+		if (b == blocka) {
+			blocka = blocka? 2 * blocka : 16;
+			ix->block = mensure(realloc(ix->block, blocka * sizeof(struct lineidx_block)));
+			ix->delta = mensure(realloc(ix->delta, blocka * LINEIDX_BLOCK * sizeof(uint16_t)));
+		}
+		ix->block[b].base = offset[0];
+		ix->block[b].wide = 0;
+		if (offset[k - 1] - offset[0] > UINT16_MAX) {
+			ix->wide = mensure(realloc(ix->wide,
+				(widec + 1) * LINEIDX_BLOCK * sizeof(uint32_t)));
+			for (size_t i = 0; i < k; ++i) {
+				ix->wide[widec * LINEIDX_BLOCK + i] = offset[i] - offset[0];
+			}
+			ix->block[b].wide = ++widec;
+		} else {
+			for (size_t i = 0; i < k; ++i) {
+				ix->delta[lines + i] = offset[i] - offset[0];
+			}
+		}
+		lines += k;
+	}
+	ix->lines = lines;
+	*bytes = sizeof(struct lineidx) + blocka * sizeof(struct lineidx_block)
+		+ blocka * LINEIDX_BLOCK * sizeof(uint16_t)
+		+ widec * LINEIDX_BLOCK * sizeof(uint32_t);
+	return ix;
+}
+
+/* lineidx_offset - returns the offset of the given (0-based) line. */
+static size_t lineidx_offset(const struct lineidx *ix, size_t line)
+{
+	const struct lineidx_block *b = &ix->block[line / LINEIDX_BLOCK];
+	if (b->wide) {
+		return b->base + ix->wide[(b->wide - 1) * LINEIDX_BLOCK + line % LINEIDX_BLOCK];
+	}
+	return b->base + ix->delta[line];
+}
+
+/* Preview cache - the files shown in the preview pane are memory-mapped,
+ *   line-indexed on the first line lookup, and kept in a hash table with an
+ *   LRU list.  The memory used by the views is bounded by FCACHE_MAX_BYTES;
+ *   the least recently used views are unmapped first.  A lookup of a cached
+ *   file does not issue any system call.  The cache is shared with the
+ *   prefetch thread: views in use are pinned with a reference count so that
+ *   they are never evicted under the reader.
+ */
+#define FCACHE_MAX_BYTES (64 << 20)
+#define FCACHE_BUCKETS   256
+struct fview {
+	char *path;
+	const char *base;
+	size_t size;
+	int err;                              /* errno if the file could not be mapped */
+	struct lineidx *index;                /* built on the first line lookup */
+	size_t bytes;                         /* mapped and index bytes */
+	int refs;
+	struct fview *lru_prev, *lru_next;
+	struct fview *hash_next;
+};
+
+static pthread_mutex_t fcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fview *fcache[FCACHE_BUCKETS];
+static struct fview *fcache_mru, *fcache_lru;
+static size_t fcache_bytes;
+
+static unsigned fcache_hash(const char *path)
+{
+	unsigned h = 2166136261u;
+	for ( ; *path; ++path) {
+		h = (h ^ (unsigned char)*path) * 16777619u;
+	}
+	return h % FCACHE_BUCKETS;
+}
+
+static void fcache_unlink(struct fview *v)
+{
+	if (v->lru_prev) {
+		v->lru_prev->lru_next = v->lru_next;
+	} else {
+		fcache_mru = v->lru_next;
+	}
+	if (v->lru_next) {
+		v->lru_next->lru_prev = v->lru_prev;
+	} else {
+		fcache_lru = v->lru_prev;
+	}
+	v->lru_prev = v->lru_next = NULL;
+}
+
+static void fcache_push(struct fview *v)
+{
+	v->lru_prev = NULL;
+	v->lru_next = fcache_mru;
+	if (fcache_mru) {
+		fcache_mru->lru_prev = v;
+	} else {
+		fcache_lru = v;
+	}
+	fcache_mru = v;
+}
+
+/* fview_load - maps a file; called without holding the lock. */
+static struct fview *fview_load(const char *path)
+{
+	struct fview *v = mensure(calloc(1, sizeof(struct fview)));
+	v->path = mensure(strdup(path));
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		v->err = errno;
+		return v;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		v->err = errno;
+	} else if (!S_ISREG(st.st_mode)) {
+		v->err = EINVAL;
+	} else if (st.st_size > 0) {
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			v->err = errno;
+		} else {
+			v->base = p;
+			v->size = st.st_size;
+			v->bytes = v->size;
+		}
+	}
+	close(fd);
+	return v;
+}
+
+static void fview_free(struct fview *v)
+{
+	if (v->size) {
+		munmap((void *)v->base, v->size);
+	}
+	if (v->index) {
+		lineidx_free(v->index);
+	}
+	free(v->path);
+	free(v);
+}
+
+static void fcache_remove(struct fview *v)
+{
+	struct fview **pp = &fcache[fcache_hash(v->path)];
+	while (*pp != v) {
+		pp = &(*pp)->hash_next;
+	}
+	*pp = v->hash_next;
+	fcache_unlink(v);
+	fcache_bytes -= v->bytes;
+	fview_free(v);
+}
+
+/* fcache_find - looks up a cached view and marks it as recently used. */
+static struct fview *fcache_find(const char *path)
+{
+	if (fcache_mru && strcmp(fcache_mru->path, path) == 0) {
+		return fcache_mru;
+	}
+	struct fview *v = fcache[fcache_hash(path)];
+	while (v && strcmp(v->path, path) != 0) {
+		v = v->hash_next;
+	}
+	if (v) {
+		fcache_unlink(v);
+		fcache_push(v);
+	}
+	return v;
+}
+
+/* fcache_insert - adds a loaded view unless another thread was faster. */
+static struct fview *fcache_insert(struct fview *v)
+{
+	struct fview *cached = fcache_find(v->path);
+	if (cached) {
+		fview_free(v);
+		return cached;
+	}
+	for (struct fview *e = fcache_lru; e && fcache_bytes + v->bytes > FCACHE_MAX_BYTES; ) {
+		struct fview *prev = e->lru_prev;
+		if (e->refs == 0) {
+			fcache_remove(e);
+		}
+		e = prev;
+	}
+	unsigned h = fcache_hash(v->path);
+	v->hash_next = fcache[h];
+	fcache[h] = v;
+	fcache_push(v);
+	fcache_bytes += v->bytes;
+	return v;
+}
+
+/* fcache_get - returns the pinned view of the given file, loading it on a
+ *   miss.  The view must be released with fcache_put().
+ */
+static struct fview *fcache_get(const char *path)
+{
+	pthread_mutex_lock(&fcache_lock);
+	struct fview *v = fcache_find(path);
+	if (v == NULL) {
+		pthread_mutex_unlock(&fcache_lock);
+		struct fview *loaded = fview_load(path);
+		pthread_mutex_lock(&fcache_lock);
+		v = fcache_insert(loaded);
+	}
+	++v->refs;
+	pthread_mutex_unlock(&fcache_lock);
+	return v;
+}
+
+static void fcache_put(struct fview *v)
+{
+	pthread_mutex_lock(&fcache_lock);
+	--v->refs;
+	pthread_mutex_unlock(&fcache_lock);
+}
+
+/* The view shown in the preview pane stays pinned, so that the files
+ * prefetched around it never evict it while it is being indexed. */
+static struct fview *preview_view;
+
+static void preview_release()
+{
+	if (preview_view) {
+		fcache_put(preview_view);
+		preview_view = NULL;
+	}
+}
+
+/* fcache_drop - forgets the view of a file which may have been modified. */
+static void fcache_drop(const char *path)
+{
+	pthread_mutex_lock(&fcache_lock);
+	struct fview *v = fcache_find(path);
+	if (v && v->refs == 0) {
+		fcache_remove(v);
+	}
+	pthread_mutex_unlock(&fcache_lock);
+}
+
+/* fcache_clear - forgets all the views but those pinned, which their
+ *   users still read.
+ */
+static void fcache_clear()
+{
+	pthread_mutex_lock(&fcache_lock);
+	for (struct fview *v = fcache_lru; v; ) {
+		struct fview *prev = v->lru_prev;
+		if (v->refs == 0) {
+			fcache_remove(v);
+		}
+		v = prev;
+	}
+	pthread_mutex_unlock(&fcache_lock);
+}
+
+/* fview_index - returns the line index of a pinned view, building it on
+ *   first use, or NULL if the file is empty or *cancel was set meanwhile.
+ *   Both threads may get there at once; the index built last is dropped.
+ */
+static const struct lineidx *fview_index(struct fview *v, const int *cancel)
+{
+	struct lineidx *ix = __atomic_load_n(&v->index, __ATOMIC_ACQUIRE);
+	if (ix != NULL || v->size == 0) {
+		return ix;
+	}
+	size_t bytes;
+	struct lineidx *built = lineidx_build(v->base, v->size, &bytes, cancel);
+	if (built == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&fcache_lock);
+	if (v->index == NULL) {
+		__atomic_store_n(&v->index, built, __ATOMIC_RELEASE);
+		v->bytes += bytes;
+		fcache_bytes += bytes;
+		built = NULL;
+	}
+	ix = v->index;
+	pthread_mutex_unlock(&fcache_lock);
+	if (built) {
+		lineidx_free(built);
+	}
+	return ix;
+}
+
+/* fview_line - returns the start of the given (1-based) line, or NULL. */
+static const char *fview_line(struct fview *v, int line)
+{
+	const struct lineidx *ix = fview_index(v, NULL);
+	if (ix == NULL || line < 1 || (size_t)line > ix->lines) {
+		return NULL;
+	}
+	return v->base + lineidx_offset(ix, line - 1);
+}
+
+/* Prefetch - a worker thread loads and indexes the files of the matches
+ *   around the cursor into the preview cache, nearest first.  Every request
+ *   replaces the pending one, so the work queued for a position the cursor
+ *   has left is abandoned, and so is the file being indexed unless it is
+ *   still wanted.
+ */
+#define PREFETCH_MAX 256
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t prefetch_thread;
+static char *prefetch_queue[PREFETCH_MAX];
+static size_t prefetch_len, prefetch_next;
+static int prefetch_running, prefetch_quit;
+static char *prefetch_current;            /* the file being loaded, or NULL */
+static int prefetch_cancel;               /* set when it is no longer wanted */
+
+static void *prefetch_main(void *arg)
+{
+	pthread_mutex_lock(&prefetch_lock);
+	for (;;) {
+		while (!prefetch_quit && prefetch_next == prefetch_len) {
+			pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+		}
+		if (prefetch_quit) {
+			break;
+		}
+		char *path = prefetch_current = prefetch_queue[prefetch_next];
+		prefetch_queue[prefetch_next++] = NULL;
+		__atomic_store_n(&prefetch_cancel, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&prefetch_lock);
+
+		struct fview *v = fcache_get(path);
+		fview_index(v, &prefetch_cancel);
+		fcache_put(v);
+		pthread_mutex_lock(&prefetch_lock);
+		prefetch_current = NULL;
+		free(path);
+	}
+	pthread_mutex_unlock(&prefetch_lock);
+	return arg;
+}
+
+/* prefetch - replaces the pending prefetch work with the given paths. */
+static void prefetch(const char **paths, size_t n)
+{
+	pthread_mutex_lock(&prefetch_lock);
+	if (!prefetch_running) {
+		if (pthread_create(&prefetch_thread, NULL, prefetch_main, NULL) != 0) {
+			pthread_mutex_unlock(&prefetch_lock);
+			return;
+		}
+		prefetch_running = 1;
+	}
+	for (size_t i = prefetch_next; i < prefetch_len; ++i) {
+		free(prefetch_queue[i]);
+	}
+	int wanted = 0;
+	for (prefetch_len = 0; prefetch_len < n && prefetch_len < PREFETCH_MAX; ++prefetch_len) {
+		prefetch_queue[prefetch_len] = mensure(strdup(paths[prefetch_len]));
+		wanted |= prefetch_current && strcmp(prefetch_current, paths[prefetch_len]) == 0;
+	}
+	if (prefetch_current && !wanted) {
+		__atomic_store_n(&prefetch_cancel, 1, __ATOMIC_RELAXED);
+	}
+	prefetch_next = 0;
+	pthread_cond_signal(&prefetch_cond);
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+/* prefetch_stop - abandons the prefetch work and joins the thread, which
+ *   the next prefetch() starts again.
+ */
+static void prefetch_stop()
+{
+	pthread_mutex_lock(&prefetch_lock);
+	prefetch_quit = 1;
+	__atomic_store_n(&prefetch_cancel, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&prefetch_cond);
+	pthread_mutex_unlock(&prefetch_lock);
+	if (prefetch_running) {
+		pthread_join(prefetch_thread, NULL);
+		prefetch_running = 0;
+	}
+	for (size_t i = prefetch_next; i < prefetch_len; ++i) {
+		free(prefetch_queue[i]);
+	}
+	prefetch_len = prefetch_next = 0;
+	prefetch_quit = 0;
+}
+
+/* Workers - a pool of threads for scans over the matches, started on first
+ *   use.  parallel_run() splits [0, n) into a range per worker, the main
+ *   thread taking the last one, and returns once all of them are done.
+ *   Small jobs are not worth waking up the pool for.
+ */
+#define WORKERS_MAX  8
+#define PARALLEL_MIN (1 << 14)
+typedef void (*parallel_fn)(void *arg, int worker, size_t begin, size_t end);
+static pthread_t workers[WORKERS_MAX];
+static int workerc;
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+static unsigned work_gen;                 /* bumped for every job */
+static int work_pending;
+static int work_stopping;
+static parallel_fn work_fn;
+static void *work_arg;
+static size_t work_n;
+
+static void *worker_main(void *arg)
+{
+	int w = (int)(intptr_t)arg;
+	unsigned gen = 0;
+	pthread_mutex_lock(&work_lock);
+	for (;;) {
+		while (work_gen == gen && !work_stopping) {
+			pthread_cond_wait(&work_cond, &work_lock);
+		}
+		if (work_stopping) {
+			break;
+		}
+		gen = work_gen;
+		parallel_fn fn = work_fn;
+		void *a = work_arg;
+		size_t n = work_n, k = workerc + 1;
+		pthread_mutex_unlock(&work_lock);
+		fn(a, w, n * w / k, n * (w + 1) / k);
+		pthread_mutex_lock(&work_lock);
+		if (--work_pending == 0) {
+			pthread_cond_signal(&work_done);
+		}
+	}
+	pthread_mutex_unlock(&work_lock);
+	return NULL;
+}
+
+static void parallel_run(size_t n, parallel_fn fn, void *arg)
+{
+	if (workerc == 0 && n >= PARALLEL_MIN) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		while (workerc < cpus - 1 && workerc < WORKERS_MAX - 1
+			&& pthread_create(&workers[workerc], NULL, worker_main,
+				(void *)(intptr_t)workerc) == 0) {
+			++workerc;
+		}
+	}
+	if (n < PARALLEL_MIN || workerc == 0) {
+		fn(arg, 0, 0, n);
+		return;
+	}
+	pthread_mutex_lock(&work_lock);
+	work_fn = fn;
+	work_arg = arg;
+	work_n = n;
+	work_pending = workerc;
+	++work_gen;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+	fn(arg, workerc, n * workerc / (workerc + 1), n);
+	pthread_mutex_lock(&work_lock);
+	while (work_pending) {
+		pthread_cond_wait(&work_done, &work_lock);
+	}
+	pthread_mutex_unlock(&work_lock);
+}
+
+/* parallel_stop - joins the workers, which are idle between jobs */
+static void parallel_stop()
+{
+	pthread_mutex_lock(&work_lock);
+	work_stopping = 1;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+	while (workerc) {
+		pthread_join(workers[--workerc], NULL);
+	}
+	work_stopping = 0;
+}
+
+/* parallel_join - moves the results which the workers stored from the start
+ *   of their ranges next to each other, and returns their number.
+ */
+static size_t parallel_join(void *out, size_t size, const size_t *begin, const size_t *count)
+{
+	size_t n = 0;
+	for (int w = 0; w < WORKERS_MAX; ++w) {
+		memmove((char *)out + n * size, (char *)out + begin[w] * size, count[w] * size);
+		n += count[w];
+	}
+	return n;
+}
+
+/* Views - the list shows the rows of the current view, an array of match
+ *   indices (e.g. those left by the filter), or all the matches in their
+ *   order if there is none.  The list positions are rows of the view.
+ */
+static const uint32_t *view;              /* NULL: all the matches */
+static size_t viewc;
+static void (*view_order)(size_t rows);   /* orders the first rows if ranked */
+
+static size_t view_len()
+{
+	return view? viewc : matchc;
+}
+
+static size_t view_match(size_t row)
+{
+	return view? view[row] : row;
+}
+
+/* Sorting - 's' goes through the orders of the list: as the matches came
+ *   in, by path and line, by the number of matches in the file (most
+ *   first), and by directory (the files of a directory before those of its
+ *   subdirectories).  An order is a permutation of the matches, which stay
+ *   where they are: the paths are interned and ranked, then the matches
+ *   radix sorted across the workers on their file rank and line.  The
+ *   permutations are kept, so going back to an order is immediate.  Matches
+ *   coming in meanwhile are shown at the end, until they are a quarter of
+ *   the sorted ones or the children are done.
+ */
+#define SORT_MODES   4
+#define SORT_ARRIVAL 0
+#define SORT_PATH    1
+#define SORT_COUNT   2
+#define SORT_DIR     3
+#define SORT_RADIX   256
+struct sort_file {
+	char *path;
+	size_t count;
+};
+struct sort_order {
+	uint32_t *perm;                       /* the match at each position */
+	uint32_t *rank;                       /* the position of each match */
+	size_t n, alloc;
+	size_t sorted;                        /* leading matches in order, the others follow */
+};
+struct sort_item {
+	uint64_t key;
+	uint32_t match;
+};
+struct sort_job {
+	struct sort_item *in, *out;
+	const uint32_t *file_rank;
+	int shift;
+	size_t hist[WORKERS_MAX][SORT_RADIX];
+};
+static const char *const sort_names[SORT_MODES] = { "", " by path", " by count", " by directory" };
+static int sort_mode;
+static struct sort_order sort_orders[SORT_MODES];
+static struct sort_file *sort_files;
+static size_t sort_filec, sort_filea;
+static struct slot_table sort_slots;
+static uint32_t *sort_file_of;            /* the file of each match interned */
+static size_t sort_scanned, sort_scan_alloc;
+
+static int sort_file_is(uint32_t id, const char *path)
+{
+	return strcmp(sort_files[id].path, path) == 0;
+}
+
+static uint32_t sort_intern(const char *path)
+{
+	uint64_t hash = path_hash(path);
+	uint32_t found = slot_find(&sort_slots, hash, sort_file_is, path);
+	if (found != SLOT_NONE) {
+		return found;
+	}
+	if (sort_filec == sort_filea) {
+		sort_filea = sort_filea? 2 * sort_filea : 1024;
+		sort_files = mensure(realloc(sort_files, sort_filea * sizeof(struct sort_file)));
+	}
+	sort_files[sort_filec].path = mensure(strdup(path));
+	sort_files[sort_filec].count = 0;
+	slot_add(&sort_slots, hash, sort_filec);
+	return sort_filec++;
+}
+
+/* sort_scan - interns the files of the matches which came in since */
+static void sort_scan()
+{
+	struct mreader r = MREADER_INIT;
+	if (sort_scan_alloc < matchc) {
+		sort_scan_alloc = 2 * matchc;
+		sort_file_of = mensure(realloc(sort_file_of, sort_scan_alloc * sizeof(uint32_t)));
+	}
+	for ( ; sort_scanned < matchc; ++sort_scanned) {
+		uint32_t id = sort_intern(mreader_at(&r, sort_scanned)->filepath);
+		sort_file_of[sort_scanned] = id;
+		++sort_files[id].count;
+	}
+	mreader_free(&r);
+}
+
+static int sort_by_path(const void *a, const void *b)
+{
+	return strcmp(sort_files[*(const uint32_t *)a].path, sort_files[*(const uint32_t *)b].path);
+}
+
+static int sort_by_count(const void *a, const void *b)
+{
+	size_t ca = sort_files[*(const uint32_t *)a].count, cb = sort_files[*(const uint32_t *)b].count;
+	return ca != cb? (ca < cb) - (ca > cb) : sort_by_path(a, b);
+}
+
+/* sort_by_dir - orders the files by directory, a directory before its
+ *   subdirectories.  The '/' sorts before any other byte, so that "a/z"
+ *   comes before "a-b" and every subtree stays in one piece.
+ */
+static int sort_by_dir(const void *a, const void *b)
+{
+	const char *pa = sort_files[*(const uint32_t *)a].path, *pb = sort_files[*(const uint32_t *)b].path;
+	const char *sa = strrchr(pa, '/'), *sb = strrchr(pb, '/');
+	size_t la = sa? (size_t)(sa - pa) : 0, lb = sb? (size_t)(sb - pb) : 0;
+	for (size_t i = 0; i < la && i < lb; ++i) {
+		int ca = pa[i] == '/'? 0 : (unsigned char)pa[i] + 1;
+		int cb = pb[i] == '/'? 0 : (unsigned char)pb[i] + 1;
+		if (ca != cb) {
+			return ca - cb;
+		}
+	}
+	if (la != lb) {
+		return la < lb? -1 : 1;
+	}
+	return strcmp(pa + la, pb + lb);
+}
+
+static void sort_fill(void *arg, int worker, size_t begin, size_t end)
+{
+	struct sort_job *j = arg;
+	struct mreader r = MREADER_INIT;
+	for (size_t i = begin; i < end; ++i) {
+		j->in[i].key = (uint64_t)j->file_rank[sort_file_of[i]] << 32
+			| (uint32_t)mreader_at(&r, i)->line;
+		j->in[i].match = i;
+	}
+	mreader_free(&r);
+}
+
+static void sort_count(void *arg, int worker, size_t begin, size_t end)
+{
+	struct sort_job *j = arg;
+	for (size_t i = begin; i < end; ++i) {
+		++j->hist[worker][(j->in[i].key >> j->shift) & (SORT_RADIX - 1)];
+	}
+}
+
+/* The workers scatter their ranges in the same order, so every pass is
+ * stable. */
+static void sort_scatter(void *arg, int worker, size_t begin, size_t end)
+{
+	struct sort_job *j = arg;
+	size_t *next = j->hist[worker];
+	for (size_t i = begin; i < end; ++i) {
+		j->out[next[(j->in[i].key >> j->shift) & (SORT_RADIX - 1)]++] = j->in[i];
+	}
+}
+
+/* sort_build - computes the permutation of an order for all the matches */
+static void sort_build(int mode)
+{
+	static int (*const cmp[SORT_MODES])(const void *, const void *) = {
+		NULL, sort_by_path, sort_by_count, sort_by_dir
+	};
+	struct sort_order *o = &sort_orders[mode];
+	struct sort_job j;
+	size_t n = matchc;
+	sort_scan();
+	uint32_t *ids = mensure(malloc((sort_filec + 1) * sizeof(uint32_t)));
+	uint32_t *file_rank = mensure(malloc((sort_filec + 1) * sizeof(uint32_t)));
+	for (size_t i = 0; i < sort_filec; ++i) {
+		ids[i] = i;
+	}
+	qsort(ids, sort_filec, sizeof(uint32_t), cmp[mode]);
+	for (size_t i = 0; i < sort_filec; ++i) {
+		file_rank[ids[i]] = i;
+	}
+	j.in = mensure(malloc((n? n : 1) * sizeof(struct sort_item)));
+	j.out = mensure(malloc((n? n : 1) * sizeof(struct sort_item)));
+	j.file_rank = file_rank;
+	parallel_run(n, sort_fill, &j);
+	for (j.shift = 0; j.shift < 64; j.shift += 8) {
+		memset(j.hist, 0, sizeof(j.hist));
+		parallel_run(n, sort_count, &j);
+		size_t at = 0, busy = 0;
+		for (int d = 0; d < SORT_RADIX; ++d) {
+			size_t total = 0;
+			for (int w = 0; w < WORKERS_MAX; ++w) {
+				size_t c = j.hist[w][d];
+				j.hist[w][d] = at + total;
+				total += c;
+			}
+			busy += total != 0;
+			at += total;
+		}
+		if (busy > 1) {
+			parallel_run(n, sort_scatter, &j);
+			struct sort_item *t = j.in;
+			j.in = j.out;
+			j.out = t;
+		}
+	}
+	if (o->alloc < n) {
+		o->alloc = n;
+		o->perm = mensure(realloc(o->perm, n * sizeof(uint32_t)));
+		o->rank = mensure(realloc(o->rank, n * sizeof(uint32_t)));
+	}
+	for (size_t i = 0; i < n; ++i) {
+		o->perm[i] = j.in[i].match;
+		o->rank[j.in[i].match] = i;
+	}
+	o->n = o->sorted = n;
+	free(j.in);
+	free(j.out);
+	free(file_rank);
+	free(ids);
+}
+
+/* sort_base - returns the matches in the current order, NULL if that is the
+ *   order they came in, those since the last sort at the end.
+ */
+static const uint32_t *sort_base(size_t *n)
+{
+	struct sort_order *o = &sort_orders[sort_mode];
+	*n = matchc;
+	if (sort_mode == SORT_ARRIVAL) {
+		return NULL;
+	} else if (o->alloc < matchc) {
+		o->alloc = 2 * o->alloc > matchc? 2 * o->alloc : matchc;
+		o->perm = mensure(realloc(o->perm, o->alloc * sizeof(uint32_t)));
+		o->rank = mensure(realloc(o->rank, o->alloc * sizeof(uint32_t)));
+	}
+	for ( ; o->n < matchc; ++o->n) {
+		o->perm[o->n] = o->rank[o->n] = o->n;
+	}
+	return o->perm;
+}
+
+static size_t sort_position(size_t match)
+{
+	return sort_mode == SORT_ARRIVAL? match : sort_orders[sort_mode].rank[match];
+}
+
+/* sort_due - tells whether the current order is to be computed again */
+static int sort_due(int done)
+{
+	const struct sort_order *o = &sort_orders[sort_mode];
+	return sort_mode != SORT_ARRIVAL && o->sorted < matchc
+		&& (done || matchc - o->sorted >= o->sorted / 4);
+}
+
+static void sort_clear()
+{
+	for (int mode = 0; mode < SORT_MODES; ++mode) {
+		free(sort_orders[mode].perm);
+		free(sort_orders[mode].rank);
+	}
+	memset(sort_orders, 0, sizeof(sort_orders));
+	for (size_t i = 0; i < sort_filec; ++i) {
+		free(sort_files[i].path);
+	}
+	slot_clear(&sort_slots);
+	free(sort_file_of);
+	sort_file_of = NULL;
+	sort_filec = sort_scanned = sort_scan_alloc = 0;
+}
+
+/* Directories - 'd' shows how many matches there are under each directory,
+ *   like du(1), the busiest first, and Enter goes into a directory, which
+ *   also restricts the list to the matches under it (the scope).  The paths
+ *   are kept in a trie over interned path components, the children of a
+ *   node found by hashing (node, component).  Once the view has been
+ *   opened, every match that comes in is added to the counts of its
+ *   directories, and to the matches of its file, so that the scope is
+ *   gathered from the files under it only.
+ */
+struct dir_node {
+	uint32_t parent, comp;
+	uint32_t child, next;                 /* first child and next sibling, 0 if none */
+	int file;                             /* a file rather than a directory */
+	uint32_t *matches;                    /* of a file */
+	size_t n, alloc;
+	size_t count, files;                  /* matches and files under the node */
+};
+static struct dir_node *dir_nodes;
+static size_t dir_nodec, dir_nodea;
+static char **dir_comps;
+static size_t dir_compc, dir_compa;
+static struct slot_table dir_comp_slots;  /* hash of the component */
+static struct slot_table dir_child_slots; /* parent << 32 | component */
+static uint32_t *dir_of_file;             /* the node of each interned file */
+static size_t dir_filec, dir_filea;
+static size_t dir_scanned;                /* matches counted */
+static int dir_started;
+static uint32_t scope;                    /* the node the list is restricted to, 0 for all */
+static uint32_t *scope_rows;
+static size_t scope_n, scope_alloc;
+static int scope_valid;
+
+static int dir_comp_is(uint32_t id, const char *comp)
+{
+	return strcmp(dir_comps[id], comp) == 0;
+}
+
+static uint32_t dir_intern(const char *comp)
+{
+	uint64_t hash = path_hash(comp);
+	uint32_t id = slot_find(&dir_comp_slots, hash, dir_comp_is, comp);
+	if (id == SLOT_NONE) {
+		if (dir_compc == dir_compa) {
+			dir_compa = dir_compa? 2 * dir_compa : 1024;
+			dir_comps = mensure(realloc(dir_comps, dir_compa * sizeof(char *)));
+		}
+		dir_comps[dir_compc] = mensure(strdup(comp));
+		id = dir_compc++;
+		slot_add(&dir_comp_slots, hash, id);
+	}
+	return id;
+}
+
+static uint32_t dir_node_new(uint32_t parent, uint32_t comp, int file)
+{
+	if (dir_nodec == dir_nodea) {
+		dir_nodea = dir_nodea? 2 * dir_nodea : 1024;
+		dir_nodes = mensure(realloc(dir_nodes, dir_nodea * sizeof(struct dir_node)));
+	}
+	struct dir_node *d = &dir_nodes[dir_nodec];
+	memset(d, 0, sizeof(struct dir_node));
+	d->parent = parent;
+	d->comp = comp;
+	d->file = file;
+	if (dir_nodec) {
+		d->next = dir_nodes[parent].child;
+		dir_nodes[parent].child = dir_nodec;
+	}
+	return dir_nodec++;
+}
+
+static uint32_t dir_child(uint32_t parent, uint32_t comp, int file)
+{
+	uint64_t key = (uint64_t)parent << 32 | comp;
+	uint32_t id = slot_find(&dir_child_slots, key, NULL, NULL);
+	if (id == SLOT_NONE) {
+		id = dir_node_new(parent, comp, file);
+		slot_add(&dir_child_slots, key, id);
+	}
+	return id;
+}
+
+/* dir_insert - adds the nodes of a file path, e.g. "", "usr", "a.h" for
+ *   "/usr/a.h", and returns the node of the file.
+ */
+static uint32_t dir_insert(const char *path)
+{
+	char comp[MATCH_PATH_LEN];
+	uint32_t node = 0;
+	for (const char *p = path, *slash; ; p = slash + 1) {
+		slash = strchr(p, '/');
+		size_t len = slash? (size_t)(slash - p) : strlen(p);
+		if (len || p == path) {
+			memcpy(comp, p, len);
+			comp[len] = '\0';
+			node = dir_child(node, dir_intern(comp), slash == NULL);
+		}
+		if (slash == NULL) {
+			break;
+		}
+	}
+	for (uint32_t n = node; ; n = dir_nodes[n].parent) {
+		++dir_nodes[n].files;
+		if (n == 0) {
+			break;
+		}
+	}
+	return node;
+}
+
+/* dir_under - tells whether a node is in the subtree of another */
+static int dir_under(uint32_t node, uint32_t top)
+{
+	while (node && node != top) {
+		node = dir_nodes[node].parent;
+	}
+	return node == top;
+}
+
+/* dir_scan - adds the matches which came in since to the trie */
+static void dir_scan()
+{
+	if (dir_nodec == 0) {
+		dir_node_new(0, dir_intern(""), 0);
+	}
+	sort_scan();
+	if (dir_filea < sort_filec) {
+		dir_filea = 2 * sort_filec;
+		dir_of_file = mensure(realloc(dir_of_file, dir_filea * sizeof(uint32_t)));
+	}
+	for ( ; dir_filec < sort_filec; ++dir_filec) {
+		dir_of_file[dir_filec] = dir_insert(sort_files[dir_filec].path);
+	}
+	for ( ; dir_scanned < matchc; ++dir_scanned) {
+		uint32_t file = dir_of_file[sort_file_of[dir_scanned]];
+		struct dir_node *f = &dir_nodes[file];
+		if (f->n == f->alloc) {
+			f->alloc = f->alloc? 2 * f->alloc : 4;
+			f->matches = mensure(realloc(f->matches, f->alloc * sizeof(uint32_t)));
+		}
+		f->matches[f->n++] = dir_scanned;
+		for (uint32_t n = file; ; n = dir_nodes[n].parent) {
+			++dir_nodes[n].count;
+			if (n == 0) {
+				break;
+			}
+		}
+		if (scope && scope_valid && dir_under(file, scope)) {
+			if (scope_n == scope_alloc) {
+				scope_alloc = 2 * scope_alloc;
+				scope_rows = mensure(realloc(scope_rows, scope_alloc * sizeof(uint32_t)));
+			}
+			scope_rows[scope_n++] = dir_scanned;
+		}
+	}
+}
+
+static int scope_cmp(const void *a, const void *b)
+{
+	size_t pa = sort_position(*(const uint32_t *)a), pb = sort_position(*(const uint32_t *)b);
+	return (pa > pb) - (pa < pb);
+}
+
+/* scope_build - gathers the matches of the files under the scope, in the
+ *   current order.
+ */
+static void scope_build()
+{
+	uint32_t *stack = mensure(malloc(dir_nodec * sizeof(uint32_t)));
+	size_t depth = 0;
+	scope_alloc = dir_nodes[scope].count? 2 * dir_nodes[scope].count : 16;
+	scope_rows = mensure(realloc(scope_rows, scope_alloc * sizeof(uint32_t)));
+	scope_n = 0;
+	stack[depth++] = scope;
+	while (depth) {
+		const struct dir_node *d = &dir_nodes[stack[--depth]];
+		memcpy(scope_rows + scope_n, d->matches, d->n * sizeof(uint32_t));
+		scope_n += d->n;
+		for (uint32_t c = d->child; c; c = dir_nodes[c].next) {
+			stack[depth++] = c;
+		}
+	}
+	free(stack);
+	qsort(scope_rows, scope_n, sizeof(uint32_t), scope_cmp);
+	scope_valid = 1;
+}
+
+/* scope_base - returns the matches in the scope in the current order, NULL
+ *   for all of them.
+ */
+static const uint32_t *scope_base(size_t *n)
+{
+	const uint32_t *base = sort_base(n);
+	if (!dir_started) {
+		return base;
+	}
+	dir_scan();
+	if (scope == 0) {
+		return base;
+	} else if (!scope_valid) {
+		scope_build();
+	}
+	*n = scope_n;
+	return scope_rows;
+}
+
+/* dir_path - writes the path of a node, "." for the root */
+static void dir_path(uint32_t node, char *buf, size_t len)
+{
+	uint32_t chain[MATCH_PATH_LEN];
+	size_t depth = 0;
+	for ( ; node && depth < MATCH_PATH_LEN; node = dir_nodes[node].parent) {
+		chain[depth++] = node;
+	}
+	snprintf(buf, len, "%s", depth? "" : ".");
+	while (depth--) {
+		const char *comp = dir_comps[dir_nodes[chain[depth]].comp];
+		size_t k = strlen(buf);
+		snprintf(buf + k, len - k, "%s%s", k && buf[k - 1] != '/'? "/" : "", *comp? comp : "/");
+	}
+}
+
+static void dir_clear()
+{
+	for (size_t i = 0; i < dir_nodec; ++i) {
+		free(dir_nodes[i].matches);
+	}
+	for (size_t i = 0; i < dir_compc; ++i) {
+		free(dir_comps[i]);
+	}
+	slot_clear(&dir_comp_slots);
+	slot_clear(&dir_child_slots);
+	dir_nodec = dir_compc = 0;
+	dir_filec = dir_scanned = 0;
+	scope = 0;
+	scope_valid = 0;
+}
+
+/* parse_sgr - applies the parameters of an SGR sequence (the part between
+ *   "ESC [" and "m") to the attributes of a span, and returns them.  Only
+ *   the foreground colors, bold, underline and reverse are kept.
+ */
+#define SGR_PARAMS_LEN 16
+static int parse_sgr(const char *s, const char *end, int attr)
+{
+	int v[SGR_PARAMS_LEN] = { 0 }, n = 0;
+	for ( ; s != end; ++s) {
+		if (*s == ';' || *s == ':') {
+			n += n + 1 < SGR_PARAMS_LEN;
+			v[n] = 0;
+		} else if (*s >= '0' && *s <= '9' && v[n] < 1000) {
+			v[n] = 10 * v[n] + *s - '0';
+		}
+	}
+	for (int i = 0; i <= n; ++i) {
+		int p = v[i];
+		if (p == 0) {
+			attr = 0;
+		} else if (p == 1) {
+			attr |= SPAN_BOLD;
+		} else if (p == 4) {
+			attr |= SPAN_UNDERLINE;
+		} else if (p == 7) {
+			attr |= SPAN_REVERSE;
+		} else if (p == 22) {
+			attr &= ~SPAN_BOLD;
+		} else if (p == 24) {
+			attr &= ~SPAN_UNDERLINE;
+		} else if (p == 27) {
+			attr &= ~SPAN_REVERSE;
+		} else if (p >= 30 && p <= 37) {
+			attr = (attr & ~SPAN_COLOR) | (p - 30 + 1);
+		} else if (p >= 90 && p <= 97) {
+			attr = (attr & ~SPAN_COLOR) | (p - 90 + 1) | SPAN_BOLD;
+		} else if (p == 39) {
+			attr &= ~SPAN_COLOR;
+		} else if ((p == 38 || p == 48) && i + 1 <= n) {
+			/* 256 colors (5;n) or true colors (2;r;g;b): only the first 16 are kept */
+			if (v[i + 1] == 5 && i + 2 <= n) {
+				if (p == 38 && v[i + 2] < 16) {
+					attr = (attr & ~SPAN_COLOR) | (v[i + 2] % 8 + 1);
+				}
+				i += 2;
+			} else if (v[i + 1] == 2) {
+				i += 4;
+			}
+		}
+	}
+	return attr;
+}
+
+/* span_add - records the span of a description between two offsets */
+static void span_add(struct match *m, size_t from, size_t to, int attr)
+{
+	if (attr && to > from && m->spanc < MATCH_SPANS_LEN) {
+		struct span *sp = &m->spans[m->spanc++];
+		sp->from = from;
+		sp->to = to;
+		sp->attr = attr;
+	}
+}
+
+/* parse_match - parses a line of the child output.
+ *   This function expects a line as produced by grep -n, i.e.:
+ *      <filename>:<linenumber>:<matchtext>
+ *   The maximum length for each buffer is observed.
+ *   Terminal control sequences are removed: the colors of the description
+ *   (SGR sequences, e.g. from grep --color=always) are turned into spans,
+ *   the others are dropped.  Other non-printable characters are replaced.
+ *   Returns 0 on success, or 1 if the record could not be parsed.
+ */
+#define SEPARATOR     ':'
+#define TAB_REPL      ' '
+#define TAB_STOP      4
+#define NONPRINT_REPL '.'
+#define ESC_CHAR      '\033'
+static int parse_match(const char *s, size_t n, struct match *m)
+{
+	char line_num_buf[32];
+	char *buffer = m->filepath;
+	size_t buffer_avail = sizeof(m->filepath);
+	int state = 0, attr = 0;
+	size_t open = 0;                      /* where the span with attr starts */
+	m->spanc = 0;
+	if (n && s[n - 1] == '\r') {
+		--n;
+	}
+	for (const char *end = s + n; s != end; ++s) {
+		int ch = (unsigned char)*s;
+		int appendcount = 0;
+		if (ch == ESC_CHAR && s + 1 != end && s[1] == '[') {
+			/* skip a CSI sequence up to its final byte */
+			const char *params = s + 2;
+			for (s += 2; s != end && (*s < 0x40 || *s > 0x7e); ++s)
+				;
+			if (s == end) {
+				break;
+			} else if (*s == 'm') {
+				int next = parse_sgr(params, s, attr);
+				if (next != attr && state == 2) {
+					size_t at = buffer - m->description;
+					at = at < MATCH_DESCRIPTION_LEN? at : MATCH_DESCRIPTION_LEN - 1;
+					span_add(m, open, at, attr);
+					open = at;
+				}
+				attr = next;
+			}
+			continue;
+		}
+		if (ch == SEPARATOR) {
+			/* state transition: switch buffers */
+			if (state == 0) {
+				*buffer = '\0';
+				buffer = line_num_buf;
+				buffer_avail = sizeof(line_num_buf);
+				*buffer = '\0';
+				++state;
+			} else if (state == 1) {
+				*buffer = '\0';
+				buffer = m->description;
+				buffer_avail = sizeof(m->description);
+				*buffer = '\0';
+				++state;
+			} else {
+				appendcount = 1;
+			}
+		} else if (!isprint(ch)) {
+			if (ch == '\t') {
+				ch = TAB_REPL;
+				appendcount = TAB_STOP;
+			} else {
+				ch = NONPRINT_REPL;
+				appendcount = 1;
+			}
+		} else {
+			appendcount = 1;
+		}
+		for (unsigned i = 0; i < appendcount; ++i) {
+			if (!buffer_avail) {
+				continue;
+			} else if (--buffer_avail == 0) {
+				*buffer++ = '\0';
+			} else {
+				*buffer++ = ch;
+			}
+		}
+	}
+	if (buffer_avail) {
+		*buffer = '\0';
+	}
+	if (state == 2) {
+		size_t at = buffer - m->description;
+		span_add(m, open, at < MATCH_DESCRIPTION_LEN? at : MATCH_DESCRIPTION_LEN - 1, attr);
+		m->line = atoi(line_num_buf);
+		return 0;
+	}
+	return 1;
+}
+
+static const char *match_basename(const struct match *m)
+{
+	const char *slash = strrchr(m->filepath, '/');
+	return slash? slash + 1 : m->filepath;
+}
+
+/* Curses functions */
+#define MATCH_COLOR_FG 1
+#define MATCH_COLOR_BG 2
+#define FOOTER_COLORS  3
+#define PREVIEW_COLORS 4
+#define SPAN_COLORS    5                  /* 8 pairs for the colors, then 8 on the cursor row */
+static int curses_active;
+static void init_curses()
+{
+	initscr();
+	keypad(stdscr, TRUE);
+	nodelay(stdscr, TRUE);
+	cbreak();
+	noecho();
+	curs_set(0);
+	start_color();
+	init_pair(MATCH_COLOR_FG, COLOR_WHITE, COLOR_BLUE);
+	init_pair(MATCH_COLOR_BG, COLOR_WHITE, COLOR_BLACK);
+	init_pair(FOOTER_COLORS,  COLOR_WHITE, COLOR_GREEN);
+	init_pair(PREVIEW_COLORS, COLOR_WHITE, COLOR_CYAN);
+	for (int color = 0; color < 8; ++color) {
+		init_pair(SPAN_COLORS + color, color, COLOR_BLACK);
+		init_pair(SPAN_COLORS + 8 + color, color, COLOR_BLUE);
+	}
+	curses_active = 1;
+}
+
+static void cleanup_curses()
+{
+	if (curses_active) {
+		endwin();
+		curses_active = 0;
+	}
+	matches_clear();
+	prefetch_stop();
+	parallel_stop();
+	preview_release();
+	fcache_clear();
+}
+
+/* View functions */
+/* Tree - 't' groups the rows of the view by file, under a header with the
+ *   path and the number of matches, in the order the files first show up.
+ *   Each group keeps the rows of its file, and its number of rows on screen
+ *   (the header, plus the matches unless folded) is kept in a Fenwick tree:
+ *   finding the group on a row, or folding a group with thousands of
+ *   matches, takes a logarithmic number of steps.  Space folds the group
+ *   under the cursor, and 'T' all of them; the folded files stay folded as
+ *   the view changes.  The groups follow the rows added at the end of the
+ *   view, and are built again when view_gen is bumped.
+ */
+struct tree_group {
+	uint32_t file;
+	int folded;
+	uint32_t *rows;                       /* the matches of the file, in the view order */
+	size_t n, alloc;
+};
+static int tree_on;
+static unsigned view_gen;                 /* bumped when not only rows are added */
+static unsigned tree_gen;
+static struct tree_group *tree_groups;
+static size_t tree_groupc, tree_groupa;
+static size_t *tree_fenwick;              /* rows on screen by group, from 1 */
+static uint32_t *tree_group_of;           /* the group + 1 of each file, 0 if none */
+static uint8_t *tree_folded;              /* by file */
+static size_t tree_filea;
+static size_t tree_scanned;               /* rows of the view grouped */
+
+static size_t tree_size(const struct tree_group *g)
+{
+	return 1 + (g->folded? 0 : g->n);
+}
+
+static void tree_add(size_t g, long delta)
+{
+	for (size_t i = g + 1; i <= tree_groupc; i += i & -i) {
+		tree_fenwick[i] += delta;
+	}
+}
+
+/* tree_row - returns the row of the header of a group */
+static size_t tree_row(size_t g)
+{
+	size_t row = 0;
+	for (size_t i = g; i; i -= i & -i) {
+		row += tree_fenwick[i];
+	}
+	return row;
+}
+
+/* tree_find - returns the group on a row, and the offset of the row in it */
+static size_t tree_find(size_t row, size_t *offset)
+{
+	size_t g = 0, step = 1;
+	while (2 * step <= tree_groupc) {
+		step *= 2;
+	}
+	for ( ; step; step /= 2) {
+		if (g + step <= tree_groupc && tree_fenwick[g + step] <= row) {
+			g += step;
+			row -= tree_fenwick[g];
+		}
+	}
+	*offset = row;
+	return g;
+}
+
+/* tree_index - computes the Fenwick tree over the sizes of the groups */
+static void tree_index()
+{
+	for (size_t i = 1; i <= tree_groupc; ++i) {
+		tree_fenwick[i] = tree_size(&tree_groups[i - 1]);
+		for (size_t k = 1; k < (i & -i); k *= 2) {
+			tree_fenwick[i] += tree_fenwick[i - k];
+		}
+	}
+}
+
+static void tree_reset()
+{
+	for (size_t g = 0; g < tree_groupc; ++g) {
+		free(tree_groups[g].rows);
+		tree_group_of[tree_groups[g].file] = 0;
+	}
+	tree_groupc = tree_scanned = 0;
+	tree_gen = view_gen;
+}
+
+/* tree_clear - forgets the groups and the files folded, e.g. for a new run */
+static void tree_clear()
+{
+	tree_reset();
+	memset(tree_folded, 0, tree_filea);
+	++view_gen;
+}
+
+/* tree_update - groups the rows added to the view since */
+static void tree_update()
+{
+	if (!tree_on) {
+		return;
+	} else if (tree_gen != view_gen) {
+		tree_reset();
+	}
+	size_t n = view_len();
+	if (tree_scanned == n) {
+		return;
+	} else if (view_order) {
+		view_order(n);
+	}
+	sort_scan();
+	if (tree_filea < sort_filec) {
+		size_t a = tree_filea;
+		tree_filea = 2 * sort_filec;
+		tree_group_of = mensure(realloc(tree_group_of, tree_filea * sizeof(uint32_t)));
+		tree_folded = mensure(realloc(tree_folded, tree_filea));
+		memset(tree_group_of + a, 0, (tree_filea - a) * sizeof(uint32_t));
+		memset(tree_folded + a, 0, tree_filea - a);
+	}
+	for ( ; tree_scanned < n; ++tree_scanned) {
+		uint32_t match = view_match(tree_scanned), file = sort_file_of[match];
+		if (tree_group_of[file] == 0) {
+			if (tree_groupc == tree_groupa) {
+				tree_groupa = tree_groupa? 2 * tree_groupa : 256;
+				tree_groups = mensure(realloc(tree_groups,
+					tree_groupa * sizeof(struct tree_group)));
+				tree_fenwick = mensure(realloc(tree_fenwick,
+					(tree_groupa + 1) * sizeof(size_t)));
+			}
+			struct tree_group *g = &tree_groups[tree_groupc++];
+			memset(g, 0, sizeof(struct tree_group));
+			g->file = file;
+			g->folded = tree_folded[file];
+			tree_group_of[file] = tree_groupc;
+			tree_fenwick[tree_groupc] = 1;
+			for (size_t k = 1; k < (tree_groupc & -tree_groupc); k *= 2) {
+				tree_fenwick[tree_groupc] += tree_fenwick[tree_groupc - k];
+			}
+		}
+		size_t gi = tree_group_of[file] - 1;
+		struct tree_group *g = &tree_groups[gi];
+		if (g->n == g->alloc) {
+			g->alloc = g->alloc? 2 * g->alloc : 4;
+			g->rows = mensure(realloc(g->rows, g->alloc * sizeof(uint32_t)));
+		}
+		g->rows[g->n++] = match;
+		if (!g->folded) {
+			tree_add(gi, 1);
+		}
+	}
+}
+
+/* tree_fold - folds or unfolds a group, returns the row of its header */
+static size_t tree_fold(size_t g)
+{
+	struct tree_group *t = &tree_groups[g];
+	t->folded = tree_folded[t->file] = !t->folded;
+	tree_add(g, t->folded? -(long)t->n : (long)t->n);
+	return tree_row(g);
+}
+
+static void tree_fold_all()
+{
+	int fold = 0;
+	for (size_t g = 0; g < tree_groupc && !fold; ++g) {
+		fold = !tree_groups[g].folded;
+	}
+	for (size_t g = 0; g < tree_groupc; ++g) {
+		tree_groups[g].folded = tree_folded[tree_groups[g].file] = fold;
+	}
+	tree_index();
+}
+
+/* The directory view lists the children of a node of the trie, after a
+ * ".." row unless at the root. */
+#define DIR_UP UINT32_MAX
+static int dir_on;
+static uint32_t dir_cur;                  /* the node shown */
+static uint32_t *dir_entries;
+static size_t dir_entryc, dir_entrya;
+static size_t dir_entries_at;             /* dir_scanned when listed, SIZE_MAX if stale */
+static size_t dir_list_match;             /* under the cursor of the list */
+
+static int dir_entry_cmp(const void *a, const void *b)
+{
+	const struct dir_node *da = &dir_nodes[*(const uint32_t *)a];
+	const struct dir_node *db = &dir_nodes[*(const uint32_t *)b];
+	if (da->count != db->count) {
+		return da->count < db->count? 1 : -1;
+	}
+	return strcmp(dir_comps[da->comp], dir_comps[db->comp]);
+}
+
+static void dir_list()
+{
+	if (dir_entries_at == dir_scanned) {
+		return;
+	}
+	dir_entryc = 0;
+	for (uint32_t c = dir_nodes[dir_cur].child; c; c = dir_nodes[c].next) {
+		if (dir_entryc == dir_entrya) {
+			dir_entrya = dir_entrya? 2 * dir_entrya : 64;
+			dir_entries = mensure(realloc(dir_entries, dir_entrya * sizeof(uint32_t)));
+		}
+		dir_entries[dir_entryc++] = c;
+	}
+	qsort(dir_entries, dir_entryc, sizeof(uint32_t), dir_entry_cmp);
+	dir_entries_at = dir_scanned;
+}
+
+/* dir_entry - returns the node on a row, or DIR_UP */
+static uint32_t dir_entry(size_t row)
+{
+	dir_list();
+	return dir_cur == 0? dir_entries[row] : row? dir_entries[row - 1] : DIR_UP;
+}
+
+/* List rows - the rows of the view, the headers and rows of the groups, or
+ *   the entries of a directory.
+ */
+static size_t list_len()
+{
+	if (dir_on) {
+		dir_list();
+		return dir_entryc + (dir_cur != 0);
+	}
+	tree_update();
+	return !tree_on? view_len() : tree_groupc? tree_row(tree_groupc) : 0;
+}
+
+/* list_group - returns the group whose header is on a row, or NULL */
+static const struct tree_group *list_group(size_t row)
+{
+	size_t offset, g;
+	if (!tree_on || dir_on) {
+		return NULL;
+	}
+	tree_update();
+	g = tree_find(row, &offset);
+	return offset == 0? &tree_groups[g] : NULL;
+}
+
+/* list_match - returns the match on a row, the first one of the file for
+ *   the header of a group.
+ */
+static size_t list_match(size_t row)
+{
+	size_t offset, g;
+	if (dir_on) {
+		return dir_list_match;
+	} else if (!tree_on) {
+		return view_match(row);
+	}
+	tree_update();
+	g = tree_find(row, &offset);
+	return tree_groups[g].rows[offset? offset - 1 : 0];
+}
+
+/* Prompt - a line of text typed in the footer, e.g. for the filter.  Its
+ *   owner is told about every change if it asks to, and about the end of
+ *   the input.
+ */
+#define PROMPT_LEN 128
+static char prompt_mark;                  /* shown before the text, 0 if closed */
+static char prompt_text[PROMPT_LEN];
+static size_t prompt_len;
+static void (*prompt_changed)();
+static void (*prompt_closed)(int accepted);
+
+#define EXIT_HINT     "Hit 'q' to exit  "
+#define EXIT_HINT_LEN (sizeof(EXIT_HINT) - 1)
+static void display_footer(size_t match_count)
+{
+	char footer[COLS + 1];
+	int len = prompt_mark? snprintf(footer, sizeof(footer), "%c%s", prompt_mark, prompt_text)
+		: view && viewc < match_count? snprintf(footer, sizeof(footer),
+			"%zu of %zu%s matches%s", viewc, match_count, reading_paused? "+" : "",
+			sort_names[sort_mode])
+		: snprintf(footer, sizeof(footer), "%zu%s matches%s", match_count,
+			reading_paused? "+" : "", sort_names[sort_mode]);
+	char path[MATCH_PATH_LEN];
+	if (dir_on && !prompt_mark) {
+		dir_path(dir_cur, path, sizeof(path));
+		len = snprintf(footer, sizeof(footer), "%s: %zu%s matches in %zu files", path,
+			dir_nodes[dir_cur].count, reading_paused? "+" : "", dir_nodes[dir_cur].files);
+	} else if (scope && !prompt_mark && len > 0 && len < COLS) {
+		dir_path(scope, path, sizeof(path));
+		len += snprintf(footer + len, sizeof(footer) - len, " under %s", path);
+	}
+	if (tree_on && !dir_on && !prompt_mark && len > 0 && len < COLS) {
+		list_len();
+		len += snprintf(footer + len, sizeof(footer) - len, " in %zu files", tree_groupc);
+	}
+	if (errlog_count && len > 0 && len < COLS) {
+		len += snprintf(footer + len, sizeof(footer) - len, ", stderr (%zu): %s",
+			errlog_count, errlog_line(0));
+	}
+	if (len > COLS - (int)EXIT_HINT_LEN) {
+		len = COLS - EXIT_HINT_LEN;
+	}
+	if (len < 1) {
+		return;
+	}
+	int l = COLS - len - EXIT_HINT_LEN;
+	if (l < 0) {
+		return;
+	}
+	memset(footer + len, ' ', l);
+	memcpy(footer + len + l, EXIT_HINT, EXIT_HINT_LEN);
+	footer[COLS] = '\0';
+	attron(COLOR_PAIR(FOOTER_COLORS) | A_BOLD);
+	mvprintw(LINES - 1, 0, "%s", footer);
+	attroff(COLOR_PAIR(FOOTER_COLORS) | A_BOLD);
+}
+
+/* Layout - the match list takes the upper part of the screen, followed by
+ *   the preview pane and the error pane (if enabled), and the footer on the
+ *   last line.
+ */
+#define PREVIEW_MIN_ROWS 3
+#define ERRORS_ROWS      8
+static int show_preview, show_errors;
+static int list_rows, preview_rows, error_rows;
+static void compute_layout()
+{
+	int rows = LINES - 1;
+	error_rows = show_errors? (ERRORS_ROWS < rows / 3? ERRORS_ROWS : rows / 3) : 0;
+	if (error_rows < 2) {
+		error_rows = 0;
+	}
+	rows -= error_rows;
+	preview_rows = show_preview? rows / 2 : 0;
+	if (preview_rows < PREVIEW_MIN_ROWS) {
+		preview_rows = 0;
+	}
+	list_rows = rows - preview_rows;
+}
+
+/* display_errors - shows the last lines of the error log in its pane. */
+static void display_errors()
+{
+	if (!error_rows) {
+		return;
+	}
+	int top = list_rows + preview_rows, n = error_rows - 1;
+	attron(COLOR_PAIR(PREVIEW_COLORS) | A_BOLD);
+	mvhline(top, 0, ' ', COLS);
+	mvprintw(top, 0, " stderr: %zu lines", errlog_count);
+	attroff(COLOR_PAIR(PREVIEW_COLORS) | A_BOLD);
+	size_t kept = errlog_count < ERRLOG_LINES? errlog_count : ERRLOG_LINES;
+	for (int i = 0; i < n; ++i) {
+		move(top + 1 + i, 0);
+		clrtoeol();
+		size_t k = n - 1 - i;             /* oldest line first */
+		if (k < kept) {
+			addnstr(errlog_line(k), COLS);
+		}
+	}
+}
+
+/* List view - the matches are shown as "<path> [<line>]" labels in a column,
+ *   followed by the description.  Only the visible rows are ever drawn, so
+ *   the cost of a redraw does not depend on the number of matches.
+ */
+#define LIST_MARK ">"
+static size_t list_top, list_cur;
+
+/* Column layout - the label column is as wide as LABEL_QUANTILE percent of
+ *   the labels need, but no wider than LABEL_MAX_SHARE percent of the screen.
+ *   The label widths are counted in histograms as the matches come in, so
+ *   the layout never goes through the matches themselves.  A label which
+ *   does not fit is elided: the leading directories of its path are
+ *   abbreviated to their initial, then dropped, and the base name is cut
+ *   last.
+ */
+#define LABEL_HIST_LEN  256
+#define LABEL_QUANTILE  90
+#define LABEL_MAX_SHARE 40
+static size_t label_hist[2][LABEL_HIST_LEN];  /* labels with the path, the base name */
+static int label_width;                       /* of the column last drawn */
+
+/* label_widths - returns the width of the label of a match, and the width
+ *   with only the base name of its file in *base.
+ */
+static int label_widths(const struct match *m, int *base)
+{
+	int digits = snprintf(NULL, 0, " [%d]", m->line);
+	*base = strlen(match_basename(m)) + digits;
+	return strlen(m->filepath) + digits;
+}
+
+static void label_count(int width, int base)
+{
+	++label_hist[0][width < LABEL_HIST_LEN? width : LABEL_HIST_LEN - 1];
+	++label_hist[1][base < LABEL_HIST_LEN? base : LABEL_HIST_LEN - 1];
+}
+
+static int label_quantile(const size_t *hist)
+{
+	size_t want = (matchc * LABEL_QUANTILE + 99) / 100, seen = 0;
+	int w = 0;
+	while (w < LABEL_HIST_LEN - 1 && (seen += hist[w]) < want) {
+		++w;
+	}
+	return w;
+}
+
+/* label_column - returns the width of the label column for the screen */
+static int label_column()
+{
+	int max = COLS * LABEL_MAX_SHARE / 100;
+	int width = label_quantile(label_hist[0]), base = label_quantile(label_hist[1]);
+	width = width < max? width : max;
+	if (width < base) {
+		width = base < COLS / 2? base : COLS / 2;
+	}
+	return width;
+}
+
+static void format_label(char *buf, size_t len, const struct match *m, int width)
+{
+	char line[16];
+	int n = snprintf(line, sizeof(line), " [%d]", m->line);
+	const char *base = match_basename(m);
+	if ((int)strlen(m->filepath) + n <= width) {
+		snprintf(buf, len, "%s%s", m->filepath, line);
+		return;
+	}
+	char abbr[MATCH_PATH_LEN];
+	size_t k = 0;
+	for (const char *p = m->filepath, *slash; p < base; p = slash + 1) {
+		slash = strchr(p, '/');
+		if (slash > p) {
+			abbr[k++] = *p;
+		}
+		if (*p == '.' && slash > p + 1) {
+			abbr[k++] = p[1];             /* hidden directories */
+		}
+		abbr[k++] = '/';
+	}
+	strcpy(abbr + k, base);
+	if ((int)strlen(abbr) + n <= width) {
+		snprintf(buf, len, "%s%s", abbr, line);
+	} else {
+		snprintf(buf, len, "%.*s%s", width > n? width - n : 0, base, line);
+	}
+}
+
+/* Highlighting - when the program did not color a description, the
+ *   patterns it was given (or the one of --highlight) are looked for in it
+ *   as its row is drawn.  The spans found are kept in a small cache by
+ *   match, so that only the rows looked at ever cost a regexec(), and only
+ *   once while they stay around the screen.
+ */
+#define HIGHLIGHT_MAX       8
+#define HIGHLIGHT_CACHE_LEN 1024
+#define HIGHLIGHT_ATTR      (SPAN_BOLD | (COLOR_RED + 1))
+struct highlight_slot {
+	size_t tag;                           /* index + 1 of the match, or 0 */
+	uint8_t spanc;
+	struct span spans[MATCH_SPANS_LEN];
+};
+static regex_t highlight_re[HIGHLIGHT_MAX];
+static size_t highlightc;
+static struct highlight_slot highlight_cache[HIGHLIGHT_CACHE_LEN];
+
+/* highlight_add - compiles a pattern to highlight, returns 0 on success */
+static int highlight_add(const char *pattern, int cflags)
+{
+	if (highlightc == HIGHLIGHT_MAX) {
+		return -1;
+	}
+	int err = regcomp(&highlight_re[highlightc], pattern, cflags);
+	highlightc += (err == 0);
+	return err;
+}
+
+/* highlight_spans - returns the spans of the patterns in match i */
+static const struct highlight_slot *highlight_spans(size_t i, const struct match *m)
+{
+	struct highlight_slot *slot = &highlight_cache[i % HIGHLIGHT_CACHE_LEN];
+	if (slot->tag == i + 1) {
+		return slot;
+	}
+	char hit[MATCH_DESCRIPTION_LEN] = { 0 };  /* covered by a pattern */
+	size_t len = strlen(m->description);
+	for (size_t k = 0; k < highlightc; ++k) {
+		regmatch_t rm;
+		for (size_t off = 0; off < len && regexec(&highlight_re[k], m->description + off,
+			1, &rm, off? REG_NOTBOL : 0) == 0; ) {
+			memset(hit + off + rm.rm_so, 1, rm.rm_eo - rm.rm_so);
+			off += rm.rm_eo > rm.rm_so? rm.rm_eo : rm.rm_so + 1;
+		}
+	}
+	slot->tag = i + 1;
+	slot->spanc = 0;
+	for (size_t from = 0, to; from < len && slot->spanc < MATCH_SPANS_LEN; from = to) {
+		for (to = from + 1; to < len && hit[to] == hit[from]; ++to)
+			;
+		if (hit[from]) {
+			struct span *sp = &slot->spans[slot->spanc++];
+			sp->from = from;
+			sp->to = to;
+			sp->attr = HIGHLIGHT_ATTR;
+		}
+	}
+	return slot;
+}
+
+static void highlight_clear()
+{
+	memset(highlight_cache, 0, sizeof(highlight_cache));
+}
+
+/* display_spans - applies the spans of a description printed at column x */
+static void display_spans(int row, int x, const struct span *spans, size_t n, int selected)
+{
+	for (size_t k = 0; k < n && x + spans[k].from < COLS; ++k) {
+		int from = x + spans[k].from, to = x + spans[k].to, attr = spans[k].attr;
+		int color = attr & SPAN_COLOR;
+		attr_t a = selected || (attr & SPAN_BOLD)? A_BOLD : A_NORMAL;
+		a |= (attr & SPAN_UNDERLINE? A_UNDERLINE : 0) | (attr & SPAN_REVERSE? A_REVERSE : 0);
+		short pair = color? SPAN_COLORS + 8 * selected + color - 1
+			: selected? MATCH_COLOR_FG : MATCH_COLOR_BG;
+		mvchgat(row, from, (to < COLS? to : COLS) - from, a, pair, NULL);
+	}
+}
+
+static void display_match(int row, size_t i, int width)
+{
+	const struct match *m = match_at(list_match(i));
+	int selected = (i == list_cur);
+	char label[MATCH_PATH_LEN + 32];
+	if (tree_on) {
+		snprintf(label, sizeof(label), "  [%d]", m->line);
+	} else {
+		format_label(label, sizeof(label), m, width);
+	}
+	move(row, 0);
+	clrtoeol();
+	addstr(selected? LIST_MARK : " ");
+	printw("%-*.*s ", width, width, label);
+	int x = getcurx(stdscr);
+	if (x < COLS) {
+		addnstr(m->description, COLS - x);
+	}
+	if (selected) {
+		mvchgat(row, 0, -1, A_BOLD, MATCH_COLOR_FG, NULL);
+	} else {
+		mvchgat(row, 0, -1, A_NORMAL, MATCH_COLOR_BG, NULL);
+	}
+	if (m->spanc) {
+		display_spans(row, x, m->spans, m->spanc, selected);
+	} else if (highlightc) {
+		const struct highlight_slot *h = highlight_spans(list_match(i), m);
+		display_spans(row, x, h->spans, h->spanc, selected);
+	}
+}
+
+/* display_group - prints the header of a group in the tree */
+static void display_group(int row, size_t i, const struct tree_group *g)
+{
+	move(row, 0);
+	clrtoeol();
+	addstr(i == list_cur? LIST_MARK : " ");
+	printw("%c %s (%zu)", g->folded? '+' : '-', match_at(g->rows[0])->filepath, g->n);
+	mvchgat(row, 0, -1, A_BOLD, i == list_cur? MATCH_COLOR_FG : MATCH_COLOR_BG, NULL);
+}
+
+/* display_dir - prints an entry of the directory view */
+static void display_dir(int row, size_t i, int width)
+{
+	uint32_t node = dir_entry(i);
+	const struct dir_node *d = &dir_nodes[node == DIR_UP? dir_cur : node];
+	const char *comp = dir_comps[d->comp];
+	size_t total = dir_nodes[dir_cur].count;
+	move(row, 0);
+	clrtoeol();
+	addstr(i == list_cur? LIST_MARK : " ");
+	if (node == DIR_UP) {
+		printw("%*s  ..", width + 8, "");
+	} else {
+		printw("%*zu %6.1f%%  %s%s", width, d->count, total? 100.0 * d->count / total : 0.0,
+			comp, d->file? "" : "/");
+	}
+	if (i == list_cur) {
+		mvchgat(row, 0, -1, A_BOLD, MATCH_COLOR_FG, NULL);
+	} else {
+		mvchgat(row, 0, -1, d->file? A_NORMAL : A_BOLD, MATCH_COLOR_BG, NULL);
+	}
+}
+
+static void display_list()
+{
+	size_t n = list_len();
+	if (dir_on) {
+		int width = snprintf(NULL, 0, "%zu", dir_nodes[dir_cur].count);
+		for (int row = 0; row < list_rows; ++row) {
+			if (list_top + row < n) {
+				display_dir(row, list_top + row, width);
+			} else {
+				move(row, 0);
+				clrtoeol();
+			}
+		}
+		return;
+	}
+	if (view_order) {
+		view_order(list_top + list_rows);
+	}
+	label_width = label_column();
+	if (tree_on) {
+		label_width = 0;
+		for (int row = 0; row < list_rows && list_top + row < n; ++row) {
+			int w = snprintf(NULL, 0, "  [%d]", match_at(list_match(list_top + row))->line);
+			label_width = w > label_width? w : label_width;
+		}
+	}
+	for (int row = 0; row < list_rows; ++row) {
+		const struct tree_group *g = list_top + row < n? list_group(list_top + row) : NULL;
+		if (g) {
+			display_group(row, list_top + row, g);
+		} else if (list_top + row < n) {
+			display_match(row, list_top + row, label_width);
+		} else {
+			move(row, 0);
+			clrtoeol();
+		}
+	}
+}
+
+/* list_scroll - moves the cursor and the top row, keeping both in range */
+static void list_scroll(long cur_delta, long top_delta)
+{
+	long last = (long)list_len() - 1, cur = (long)list_cur + cur_delta;
+	long top = (long)list_top + top_delta, max_top = (long)list_len() - list_rows;
+	cur = cur > last? last : cur;
+	cur = cur < 0? 0 : cur;
+	top = top > max_top? max_top : top;
+	top = top < 0? 0 : top;
+	if (cur < top) {
+		top = cur;
+	} else if (cur >= top + list_rows) {
+		top = cur - list_rows + 1;
+	}
+	list_cur = cur;
+	list_top = top;
+	if (view_order) {
+		view_order(list_top + list_rows);
+	}
+}
+
+/* display_text - prints a line of file contents, clipped to the given width.
+ *   Tabs and non-printable characters are replaced as in parse_match().
+ */
+static void display_text(const char *s, size_t n, int width)
+{
+	if (n && s[n - 1] == '\r') {
+		--n;
+	}
+	for (size_t i = 0; i < n && width > 0; ++i) {
+		int ch = (unsigned char)s[i], count = 1;
+		if (ch == '\t') {
+			ch = TAB_REPL;
+			count = TAB_STOP;
+		} else if (!isprint(ch)) {
+			ch = NONPRINT_REPL;
+		}
+		for ( ; count && width; --count, --width) {
+			addch(ch);
+		}
+	}
+}
+
+/* display_preview - shows the lines surrounding the current match.  A
+ *   file larger than PREVIEW_SYNC_MAX is only indexed by the prefetch
+ *   thread, so that the keys are never kept waiting: until then the pane
+ *   says so, and is drawn again every PREVIEW_POLL_MS.
+ */
+#define PREVIEW_SYNC_MAX (1 << 20)
+#define PREVIEW_POLL_MS  50
+static struct timer preview_timer;
+static void display_preview()
+{
+	if (!preview_rows) {
+		return;
+	} else if (list_cur >= list_len() || dir_on) {
+		for (int row = list_rows; row < list_rows + preview_rows; ++row) {
+			move(row, 0);
+			clrtoeol();
+		}
+		return;
+	}
+	const struct match *m = match_at(list_match(list_cur));
+	if (preview_view == NULL || strcmp(preview_view->path, m->filepath) != 0) {
+		preview_release();
+		preview_view = fcache_get(m->filepath);
+	}
+	struct fview *v = preview_view;
+
+	char header[MATCH_PATH_LEN + 32];
+	int len = snprintf(header, sizeof(header), " %s:%d", m->filepath, m->line);
+	attron(COLOR_PAIR(PREVIEW_COLORS) | A_BOLD);
+	mvhline(list_rows, 0, ' ', COLS);
+	mvaddnstr(list_rows, 0, len > COLS? header + len - COLS : header, COLS);
+	attroff(COLOR_PAIR(PREVIEW_COLORS) | A_BOLD);
+
+	int n = preview_rows - 1;
+	int first = m->line - (n - 1) / 2;
+	if (first < 1) {
+		first = 1;
+	}
+	int gutter = snprintf(NULL, 0, "%d", first + n - 1);
+	int loading = !v->err && v->size > PREVIEW_SYNC_MAX
+		&& __atomic_load_n(&v->index, __ATOMIC_ACQUIRE) == NULL;
+	const char *p = v->err || loading? NULL : fview_line(v, first);
+	const char *end = v->base + v->size;
+	if (loading) {
+		timer_arm(&preview_timer, PREVIEW_POLL_MS);
+	}
+	for (int i = 0; i < n; ++i) {
+		int row = list_rows + 1 + i;
+		move(row, 0);
+		clrtoeol();
+		if (i == 0 && v->err) {
+			printw("%s: %s", m->filepath, strerror(v->err));
+		} else if (i == 0 && loading) {
+			printw("Indexing %s...", m->filepath);
+		}
+		if (p == NULL) {
+			continue;
+		}
+		const char *eol = memchr(p, '\n', end - p);
+		if (eol == NULL) {
+			eol = end;
+		}
+		printw("%*d ", gutter, first + i);
+		display_text(p, eol - p, COLS - gutter - 1);
+		if (first + i == m->line) {
+			mvchgat(row, 0, -1, A_BOLD, MATCH_COLOR_FG, NULL);
+		}
+		p = (eol + 1 < end)? eol + 1 : NULL;
+	}
+}
+
+/* prefetch_preview - queues the file under the cursor, which may not be
+ *   indexed yet (see display_preview()), then those of the next and
+ *   previous page of matches, nearest to the cursor first.  The paths are
+ *   copied, as match_at() may decode every match into the same record.
+ */
+static void prefetch_preview()
+{
+	static char copies[PREFETCH_MAX][MATCH_PATH_LEN];
+	const char *paths[PREFETCH_MAX];
+	size_t n = 1;
+	long cur = list_cur;
+	if (list_cur >= list_len() || dir_on) {
+		return;
+	}
+	paths[0] = strcpy(copies[0], match_at(list_match(cur))->filepath);
+	for (long d = 1; d <= list_rows; ++d) {
+		for (long i = cur + d; i >= cur - d; i -= 2 * d) {
+			if (i < 0 || (size_t)i >= list_len() || n == PREFETCH_MAX) {
+				continue;
+			}
+			const char *path = match_at(list_match(i))->filepath;
+			size_t k = 0;
+			while (k < n && strcmp(paths[k], path) != 0) {
+				++k;
+			}
+			if (k == n) {
+				paths[n] = strcpy(copies[n], path);
+				++n;
+			}
+		}
+	}
+	prefetch(paths, n);
+}
+
+/* Rendering - the handlers only mark the parts of the screen they change as
+ *   dirty.  These are drawn and sent to the terminal once the events at hand
+ *   are handled, and at most every FRAME_MS: a burst of keys, of matches or
+ *   of resizes costs a frame, not a frame each.
+ */
+#define FRAME_MS      16
+#define DIRTY_LIST    1
+#define DIRTY_PREVIEW 2
+#define DIRTY_ERRORS  4
+#define DIRTY_FOOTER  8
+#define DIRTY_ALL     (DIRTY_LIST | DIRTY_PREVIEW | DIRTY_ERRORS | DIRTY_FOOTER)
+#define DIRTY_SIZE    16                  /* the terminal was resized */
+static int dirty;
+static uint64_t frame_last;
+
+/* The preview follows the cursor once the keys stop coming in, so that
+ * holding down a key is never slowed down by rendering the preview. */
+#define PREVIEW_DELAY_MS 15
+static void preview_fire(struct timer *t)
+{
+	dirty |= DIRTY_PREVIEW;
+}
+static struct timer preview_timer = { 0, preview_fire };
+
+/* layout_view - applies the current layout and redraws the screen.  Only
+ *   the visible rows depend on the layout, so this does not depend on the
+ *   number of matches either.
+ */
+static void layout_view()
+{
+	compute_layout();
+	list_scroll(0, 0);
+	erase();
+	dirty |= DIRTY_ALL;
+	timer_disarm(&preview_timer);
+}
+
+static void flow_control();
+
+static void render()
+{
+	struct winsize ws;
+	if ((dirty & DIRTY_SIZE) && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) {
+		resizeterm(ws.ws_row, ws.ws_col);
+		layout_view();
+	}
+	if (dirty & DIRTY_LIST) {
+		flow_control();
+		display_list();
+	}
+	if (dirty & DIRTY_PREVIEW) {
+		display_preview();
+	}
+	if (dirty & DIRTY_ERRORS) {
+		display_errors();
+	}
+	if (dirty & DIRTY_FOOTER) {
+		display_footer(matchc);
+	}
+	refresh();
+	if ((dirty & DIRTY_PREVIEW) && preview_rows) {
+		prefetch_preview();
+	}
+	dirty = 0;
+	frame_last = now_ms();
+}
+
+static void frame_fire(struct timer *t)
+{
+	render();
+}
+static struct timer frame_timer = { 0, frame_fire };
+
+/* flush_screen - renders the dirty parts now, or when the frame is due */
+static void flush_screen()
+{
+	if (!curses_active || !dirty || frame_timer.deadline) {
+		return;
+	}
+	uint64_t elapsed = now_ms() - frame_last;
+	if (elapsed >= FRAME_MS) {
+		render();
+	} else {
+		timer_arm(&frame_timer, FRAME_MS - elapsed);
+	}
+}
+
+/* view_at - returns the match under the cursor, to find it after a change of
+ *   the view with view_goto().
+ */
+static size_t view_at()
+{
+	if (dir_on) {
+		return dir_list_match;
+	}
+	return list_cur < list_len()? list_match(list_cur) : 0;
+}
+
+static void view_goto(size_t match)
+{
+	size_t lo = 0, hi = view_len();
+	if (view_order) {
+		hi = 0;
+	} else if (view == NULL) {
+		lo = match;
+	}
+	while (view && lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (sort_position(view[mid]) < sort_position(match)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (dir_on) {
+		dir_list_match = match;
+		return;
+	} else if (tree_on && lo < view_len()) {
+		size_t shown = view_match(lo), k = 0;
+		tree_update();
+		const struct tree_group *g = &tree_groups[tree_group_of[sort_file_of[shown]] - 1];
+		for (hi = g->folded || view_order? 0 : g->n; k < hi; ) {
+			size_t mid = k + (hi - k) / 2;
+			if (sort_position(g->rows[mid]) < sort_position(shown)) {
+				k = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		lo = tree_row(g - tree_groups) + (g->folded? 0 : 1 + k);
+	} else if (tree_on) {
+		lo = list_len();
+	}
+	long row = (long)list_cur - (long)list_top;
+	list_cur = lo;
+	list_top = lo > (size_t)row? lo - row : 0;
+	list_scroll(0, 0);
+	dirty |= DIRTY_LIST | DIRTY_FOOTER;
+	timer_arm(&preview_timer, PREVIEW_DELAY_MS);
+}
+
+static void prompt_open(char mark, void (*changed)(), void (*closed)(int accepted))
+{
+	prompt_mark = mark;
+	prompt_changed = changed;
+	prompt_closed = closed;
+	dirty |= DIRTY_FOOTER;
+}
+
+/* prompt_key - edits the prompt with a key pressed count times.  Returns 0 if
+ *   the key is not for the prompt, e.g. to move the cursor.
+ */
+static int prompt_key(int c, int count)
+{
+	if (c == '\n' || c == KEY_ENTER || c == 27) {
+		prompt_mark = 0;
+		prompt_closed(c != 27);
+	} else if (c == KEY_BACKSPACE || c == 127 || c == '\b') {
+		prompt_len = prompt_len > (size_t)count? prompt_len - count : 0;
+		prompt_text[prompt_len] = '\0';
+		if (prompt_changed) {
+			prompt_changed();
+		}
+	} else if (c >= ' ' && c < 127) {
+		while (count-- && prompt_len + 1 < PROMPT_LEN) {
+			prompt_text[prompt_len++] = c;
+		}
+		prompt_text[prompt_len] = '\0';
+		if (prompt_changed) {
+			prompt_changed();
+		}
+	} else {
+		return 0;
+	}
+	dirty |= DIRTY_FOOTER;
+	return 1;
+}
+
+/* Regex rules - 'i' keeps only the matches whose path or description match
+ *   a regular expression, and 'x' drops them, e.g. to leave out tests/ and
+ *   the lines with TODO.  The rules apply in turn before the filter, and the
+ *   rows left after each one are kept, so 'X' switches all of them off and
+ *   back on at once.  Entering no expression drops the last rule.  Each
+ *   expression is compiled once per worker, as regexec() may serialize the
+ *   threads sharing one.
+ */
+#define REGEX_MAX 16
+struct regex_rule {
+	regex_t re[WORKERS_MAX];
+	int exclude;
+	uint32_t *rows;                       /* left by this rule and the ones before */
+	size_t n;
+	size_t scanned;                       /* rows looked at of the previous rule */
+};
+struct regex_job {
+	const struct regex_rule *rule;
+	const uint32_t *in;                   /* the candidates, or NULL for all from first */
+	size_t first;
+	uint32_t *out;
+	size_t begin[WORKERS_MAX], count[WORKERS_MAX];
+};
+static struct regex_rule regex_rules[REGEX_MAX];
+static int regexc;
+static int regex_off;                     /* switched off with 'X' */
+static int regex_exclude;                 /* for the rule being typed */
+
+static void regex_scan(void *arg, int worker, size_t begin, size_t end)
+{
+	struct regex_job *j = arg;
+	const regex_t *re = &j->rule->re[worker];
+	struct mreader r = MREADER_INIT;
+	size_t k = begin;
+	for (size_t i = begin; i < end; ++i) {
+		size_t match = j->in? j->in[j->first + i] : j->first + i;
+		const struct match *m = mreader_at(&r, match);
+		int hit = regexec(re, m->filepath, 0, NULL, 0) == 0
+			|| regexec(re, m->description, 0, NULL, 0) == 0;
+		if (hit != j->rule->exclude) {
+			j->out[k++] = match;
+		}
+	}
+	mreader_free(&r);
+	j->begin[worker] = begin;
+	j->count[worker] = k - begin;
+}
+
+/* regex_update - brings the rows left after rule k up to date */
+static const struct regex_rule *regex_update(int k)
+{
+	struct regex_rule *r = &regex_rules[k];
+	const struct regex_rule *p = k? regex_update(k - 1) : NULL;
+	size_t n;
+	const uint32_t *in = p? p->rows : scope_base(&n);
+	n = p? p->n : n;
+	if (r->scanned < n) {
+		struct regex_job j = { r, in, r->scanned, NULL, { 0 }, { 0 } };
+		r->rows = mensure(realloc(r->rows, (r->n + n - r->scanned) * sizeof(uint32_t)));
+		j.out = r->rows + r->n;
+		parallel_run(n - r->scanned, regex_scan, &j);
+		r->n += parallel_join(j.out, sizeof(uint32_t), j.begin, j.count);
+		r->scanned = n;
+	}
+	return r;
+}
+
+/* regex_base - returns the rows left by the rules, NULL for all the matches */
+static const uint32_t *regex_base(size_t *n)
+{
+	if (regexc == 0 || regex_off) {
+		return scope_base(n);
+	}
+	const struct regex_rule *r = regex_update(regexc - 1);
+	*n = r->n;
+	return r->rows;
+}
+
+/* regex_reset - forgets the rows left by the rules, e.g. for a new run */
+static void regex_reset()
+{
+	for (int k = 0; k < regexc; ++k) {
+		free(regex_rules[k].rows);
+		regex_rules[k].rows = NULL;
+		regex_rules[k].n = regex_rules[k].scanned = 0;
+	}
+}
+
+/* regex_add - compiles a rule, returns 0 on success */
+static int regex_add(const char *text, int exclude)
+{
+	struct regex_rule *r = &regex_rules[regexc];
+	int flags = REG_EXTENDED | REG_NOSUB | REG_ICASE, w = 0;
+	if (regexc == REGEX_MAX) {
+		return 1;
+	}
+	for (const char *p = text; *p; ++p) {
+		flags &= isupper((unsigned char)*p)? ~REG_ICASE : ~0;
+	}
+	while (w < WORKERS_MAX && regcomp(&r->re[w], text, flags) == 0) {
+		++w;
+	}
+	if (w < WORKERS_MAX) {
+		while (w--) {
+			regfree(&r->re[w]);
+		}
+		return 1;
+	}
+	r->exclude = exclude;
+	++regexc;
+	return 0;
+}
+
+static void regex_drop()
+{
+	struct regex_rule *r = &regex_rules[--regexc];
+	for (int w = 0; w < WORKERS_MAX; ++w) {
+		regfree(&r->re[w]);
+	}
+	free(r->rows);
+	memset(r, 0, sizeof(struct regex_rule));
+}
+
+/* Filter - '&' narrows the list down to the matches whose path or
+ *   description contains the text typed, as in less(1); a text without
+ *   capitals matches regardless of case.  The rows left for each length of
+ *   the text are kept: a longer text only looks at the rows of the shorter
+ *   one, and erasing a character goes back to them at once, as does 'X' to
+ *   those for the rules switched the other way.  The scans are split across
+ *   the workers, and rely on the libc string search (which is vectorized
+ *   where it matters).
+ */
+struct filter_level {
+	uint32_t *rows;
+	size_t n;
+	size_t scanned;                       /* matches looked at */
+};
+struct filter_job {
+	const char *text;
+	int icase;
+	const uint32_t *in;                   /* the candidates, or NULL for all from first */
+	size_t first;
+	uint32_t *out;
+	size_t begin[WORKERS_MAX], count[WORKERS_MAX];
+};
+static char filter_text[PROMPT_LEN];
+static size_t filter_len;
+static unsigned filter_gen;               /* bumped whenever the rows change */
+static struct filter_level filter_levels[PROMPT_LEN];    /* by length of the text */
+static struct filter_level filter_other[PROMPT_LEN];     /* with the rules switched by 'X' */
+static size_t filter_otherc;              /* levels of filter_other up to date */
+
+static void filter_scan(void *arg, int worker, size_t begin, size_t end)
+{
+	struct filter_job *j = arg;
+	struct mreader r = MREADER_INIT;
+	size_t k = begin;
+	for (size_t i = begin; i < end; ++i) {
+		size_t match = j->in? j->in[j->first + i] : j->first + i;
+		const struct match *m = mreader_at(&r, match);
+		if (j->icase? strcasestr(m->description, j->text) || strcasestr(m->filepath, j->text)
+			: strstr(m->description, j->text) || strstr(m->filepath, j->text)) {
+			j->out[k++] = match;
+		}
+	}
+	mreader_free(&r);
+	j->begin[worker] = begin;
+	j->count[worker] = k - begin;
+}
+
+/* filter_run - stores the matching ones among n candidates into out, which
+ *   has room for n, and returns their number.
+ */
+static size_t filter_run(const char *text, const uint32_t *in, size_t first, size_t n,
+	uint32_t *out)
+{
+	struct filter_job j = { text, 1, in, first, out, { 0 }, { 0 } };
+	for (const char *p = text; *p; ++p) {
+		j.icase &= !isupper((unsigned char)*p);
+	}
+	parallel_run(n, filter_scan, &j);
+	return parallel_join(out, sizeof(uint32_t), j.begin, j.count);
+}
+
+/* filter_update - brings the rows for the first len characters of the text
+ *   up to date with the rows left by the rules since.
+ */
+static struct filter_level *filter_update(size_t len)
+{
+	struct filter_level *l = &filter_levels[len];
+	size_t basec;
+	const uint32_t *base = regex_base(&basec);
+	if (l->scanned < basec) {
+		char text[PROMPT_LEN];
+		size_t n = basec - l->scanned;
+		memcpy(text, filter_text, len);
+		text[len] = '\0';
+		l->rows = mensure(realloc(l->rows, (l->n + n) * sizeof(uint32_t)));
+		l->n += filter_run(text, base, l->scanned, n, l->rows + l->n);
+		l->scanned = basec;
+	}
+	return l;
+}
+
+/* filter_refine - computes the rows for the first len characters of the
+ *   text from those for one less.
+ */
+static void filter_refine(size_t len)
+{
+	const struct filter_level *p = len > 1? filter_update(len - 1) : NULL;
+	struct filter_level *l = &filter_levels[len];
+	size_t basec, n;
+	const uint32_t *base = regex_base(&basec);
+	char text[PROMPT_LEN];
+	n = p? p->n : basec;
+	memcpy(text, filter_text, len);
+	text[len] = '\0';
+	l->rows = mensure(malloc((n? n : 1) * sizeof(uint32_t)));
+	l->n = filter_run(text, p? p->rows : base, 0, n, l->rows);
+	l->rows = mensure(realloc(l->rows, (l->n? l->n : 1) * sizeof(uint32_t)));
+	l->scanned = basec;
+}
+
+/* filter_drop_other - forgets the levels kept for the rules switched the
+ *   other way past the first len characters.
+ */
+static void filter_drop_other(size_t len)
+{
+	for ( ; filter_otherc > len; --filter_otherc) {
+		free(filter_other[filter_otherc].rows);
+		memset(&filter_other[filter_otherc], 0, sizeof(struct filter_level));
+	}
+}
+
+/* filter_switch - trades the levels for those kept from before the rules
+ *   were last switched with 'X', computing only the ones missing there.
+ */
+static void filter_switch()
+{
+	size_t kept = filter_otherc;
+	for (size_t len = 1; len <= filter_len; ++len) {
+		struct filter_level t = filter_levels[len];
+		filter_levels[len] = filter_other[len];
+		filter_other[len] = t;
+	}
+	filter_otherc = filter_len;
+	while (kept < filter_len) {
+		filter_refine(++kept);
+	}
+	++filter_gen;
+}
+
+/* filter_rebuild - computes the rows for the text again, once the rows left
+ *   by the rules have changed.
+ */
+static void filter_rebuild()
+{
+	filter_drop_other(0);
+	for (size_t len = 1; len <= filter_len; ++len) {
+		free(filter_levels[len].rows);
+		filter_refine(len);
+	}
+	++filter_gen;
+}
+
+static void filter_clear()
+{
+	filter_drop_other(0);
+	for ( ; filter_len; --filter_len) {
+		free(filter_levels[filter_len].rows);
+		memset(&filter_levels[filter_len], 0, sizeof(struct filter_level));
+	}
+	filter_text[0] = '\0';
+	++filter_gen;
+}
+
+/* Fuzzy ranking - 'f' ranks the matches (those left by the filter, if any)
+ *   by how well the text typed matches a subsequence of their path and
+ *   description, as in fzf: each character matched scores, more so at the
+ *   start of a word or right after the previous one, and the characters
+ *   skipped in between count against.  The ranking is done a slice at a
+ *   time across the workers, with the previous one on screen until it is
+ *   complete, so that a key pressed meanwhile just starts over.  A longer
+ *   text only scores the matches of the shorter one.  Only the rows down to
+ *   the bottom of the list are put in order.
+ */
+#define FUZZY_CHUNK    (1 << 16)
+#define FUZZY_SLICE_MS 8
+#define FUZZY_SCAN_MAX 1024                /* characters of a match scored */
+#define FUZZY_NONE     (INT_MIN / 2)
+#define SCORE_MATCH    16
+#define SCORE_GAP      1
+#define BONUS_NEXT     4
+#define BONUS_WORD     8
+#define BONUS_PATH     10                  /* right after a '/' */
+#define BONUS_CAMEL    6
+struct fuzzy_hit {
+	uint32_t match;
+	int score;
+};
+struct ranking {
+	char text[PROMPT_LEN];
+	struct fuzzy_hit *hits;
+	uint32_t *rows;                       /* the matches of the hits, for the view */
+	size_t n, alloc;
+	size_t sorted;                        /* leading hits in order */
+	uint32_t *from;                       /* the matches of a previous ranking to score */
+	size_t fromc, fromk;
+	size_t next;                          /* next row of the base to score */
+	unsigned base_gen;
+};
+struct fuzzy_job {
+	const char *text;
+	size_t len;
+	int icase;
+	const uint32_t *in;                   /* the candidates, or NULL for all from first */
+	size_t first;
+	struct fuzzy_hit *out;
+	size_t begin[WORKERS_MAX], count[WORKERS_MAX];
+};
+static char fuzzy_text[PROMPT_LEN];
+static struct ranking rank_shown, rank_next;
+static int fuzzy_busy;                    /* rank_next is under way */
+
+static int fuzzy_bonus(char prev, char c)
+{
+	if (prev == '/') {
+		return BONUS_PATH;
+	} else if (islower((unsigned char)prev) && isupper((unsigned char)c)) {
+		return BONUS_CAMEL;
+	}
+	return !isalnum((unsigned char)prev) && isalnum((unsigned char)c)? BONUS_WORD : 0;
+}
+
+/* fuzzy_score - scores the best alignment of the text as a subsequence of
+ *   the path and description of a match, or returns FUZZY_NONE.  For each
+ *   character of the text, chain holds the best score of an alignment
+ *   ending right on the previous character of the match, and best that of
+ *   any alignment so far, less the gap since.
+ */
+static int fuzzy_score(const struct match *m, const char *text, size_t len, int icase)
+{
+	const char *seg[2] = { m->filepath, m->description };
+	int chain[PROMPT_LEN], best[PROMPT_LEN], top = FUZZY_NONE;
+	size_t k = 0, scanned = 0;
+	for (int s = 0; s < 2 && k < len; ++s) {
+		for (const char *p = seg[s]; *p && k < len; ++p) {
+			k += (icase? tolower((unsigned char)*p) : *p) == text[k];
+		}
+	}
+	if (k < len) {
+		return FUZZY_NONE;
+	}
+	for (k = 0; k < len; ++k) {
+		chain[k] = best[k] = FUZZY_NONE;
+	}
+	for (int s = 0; s < 2; ++s) {
+		char prev = ' ';
+		for (const char *p = seg[s]; *p && scanned < FUZZY_SCAN_MAX; prev = *p++, ++scanned) {
+			char c = icase? tolower((unsigned char)*p) : *p;
+			int bonus = fuzzy_bonus(prev, *p);
+			for (k = len; k-- > 0; ) {
+				int score = FUZZY_NONE;
+				if (c == text[k]) {
+					int before = k? best[k - 1] : 0;
+					int next = k? chain[k - 1] + BONUS_NEXT : FUZZY_NONE;
+					before = next > before? next : before;
+					score = before > FUZZY_NONE / 2? before + SCORE_MATCH + bonus : FUZZY_NONE;
+				}
+				chain[k] = score;
+				best[k] = best[k] - SCORE_GAP > score? best[k] - SCORE_GAP : score;
+			}
+			top = chain[len - 1] > top? chain[len - 1] : top;
+		}
+	}
+	return top > FUZZY_NONE / 2? top : FUZZY_NONE;
+}
+
+static void fuzzy_scan(void *arg, int worker, size_t begin, size_t end)
+{
+	struct fuzzy_job *j = arg;
+	struct mreader r = MREADER_INIT;
+	size_t k = begin;
+	for (size_t i = begin; i < end; ++i) {
+		uint32_t match = j->in? j->in[j->first + i] : j->first + i;
+		int score = fuzzy_score(mreader_at(&r, match), j->text, j->len, j->icase);
+		if (score != FUZZY_NONE) {
+			j->out[k].match = match;
+			j->out[k++].score = score;
+		}
+	}
+	mreader_free(&r);
+	j->begin[worker] = begin;
+	j->count[worker] = k - begin;
+}
+
+/* fuzzy_run - scores n candidates, the rows from first of in (or the
+ *   matches from first if NULL), and adds those which match to the hits.
+ */
+static void fuzzy_run(struct ranking *r, const uint32_t *in, size_t first, size_t n)
+{
+	struct fuzzy_job j = { r->text, strlen(r->text), 1, in, first, NULL, { 0 }, { 0 } };
+	for (const char *p = r->text; *p; ++p) {
+		j.icase &= !isupper((unsigned char)*p);
+	}
+	if (r->n + n > r->alloc) {
+		r->alloc = r->n + n > 2 * r->alloc? r->n + n : 2 * r->alloc;
+		r->hits = mensure(realloc(r->hits, r->alloc * sizeof(struct fuzzy_hit)));
+	}
+	j.out = r->hits + r->n;
+	parallel_run(n, fuzzy_scan, &j);
+	r->n += parallel_join(j.out, sizeof(struct fuzzy_hit), j.begin, j.count);
+}
+
+static int hit_before(const struct fuzzy_hit *a, const struct fuzzy_hit *b)
+{
+	return a->score > b->score || (a->score == b->score && a->match < b->match);
+}
+
+static int hit_cmp(const void *a, const void *b)
+{
+	return hit_before(a, b)? -1 : hit_before(b, a);
+}
+
+/* fuzzy_select - partitions the hits in [lo, hi) around k, so that the ones
+ *   before k are the best ones (in no particular order).
+ */
+static void fuzzy_select(struct fuzzy_hit *h, size_t lo, size_t hi, size_t k)
+{
+	while (hi - lo > 1) {
+		struct fuzzy_hit pivot = h[lo + (hi - 1 - lo) / 2], t;
+		size_t i = lo, j = hi - 1;
+		for (;;) {
+			while (hit_before(&h[i], &pivot)) {
+				++i;
+			}
+			while (hit_before(&pivot, &h[j])) {
+				--j;
+			}
+			if (i >= j) {
+				break;
+			}
+			t = h[i];
+			h[i++] = h[j];
+			h[j--] = t;
+		}
+		if (k <= j) {
+			hi = j + 1;
+		} else if (k > j + 1) {
+			lo = j + 1;
+		} else {
+			return;
+		}
+	}
+}
+
+/* fuzzy_order - puts at least the first rows of the ranking on screen in
+ *   order, and twice as many as before so that scrolling down stays cheap.
+ *   The selection moves the hits after the sorted ones around too, so their
+ *   rows are all rewritten.
+ */
+static void fuzzy_order(size_t rows)
+{
+	struct ranking *r = &rank_shown;
+	if (rows <= r->sorted || r->sorted == r->n) {
+		return;
+	}
+	size_t k = rows > 2 * r->sorted? rows : 2 * r->sorted;
+	k = k > r->n? r->n : k;
+	fuzzy_select(r->hits, r->sorted, r->n, k);
+	qsort(r->hits + r->sorted, k - r->sorted, sizeof(struct fuzzy_hit), hit_cmp);
+	for (size_t i = r->sorted; i < r->n; ++i) {
+		r->rows[i] = r->hits[i].match;
+	}
+	r->sorted = k;
+}
+
+static void ranking_free(struct ranking *r)
+{
+	free(r->hits);
+	free(r->rows);
+	free(r->from);
+	memset(r, 0, sizeof(struct ranking));
+}
+
+/* fuzzy_base - returns the rows to rank, NULL for all the matches */
+static const uint32_t *fuzzy_base(size_t *n)
+{
+	if (filter_len) {
+		const struct filter_level *l = filter_update(filter_len);
+		*n = l->n;
+		return l->rows;
+	}
+	return regex_base(n);
+}
+
+static struct timer fuzzy_timer;
+
+static void fuzzy_start()
+{
+	struct ranking *r = &rank_next, *s = &rank_shown;
+	size_t len = strlen(s->text);
+	ranking_free(r);
+	strcpy(r->text, fuzzy_text);
+	r->base_gen = filter_gen;
+	if (len && s->base_gen == filter_gen && strncmp(r->text, s->text, len) == 0) {
+		r->from = mensure(malloc((s->n? s->n : 1) * sizeof(uint32_t)));
+		for (size_t i = 0; i < s->n; ++i) {
+			r->from[i] = s->hits[i].match;
+		}
+		r->fromc = s->n;
+		r->next = s->next;
+	}
+	fuzzy_busy = 1;
+	timer_arm(&fuzzy_timer, 0);
+}
+
+static void view_update();
+
+/* fuzzy_publish - puts the ranking done on screen, from the top */
+static void fuzzy_publish()
+{
+	struct ranking *r = &rank_next;
+	free(r->from);
+	r->from = NULL;
+	r->fromc = r->fromk = 0;
+	r->rows = mensure(malloc((r->alloc? r->alloc : 1) * sizeof(uint32_t)));
+	for (size_t i = 0; i < r->n; ++i) {
+		r->rows[i] = r->hits[i].match;
+	}
+	ranking_free(&rank_shown);
+	rank_shown = *r;
+	memset(r, 0, sizeof(struct ranking));
+	fuzzy_busy = 0;
+	++view_gen;
+	view_update();
+	view_goto(0);
+	list_scroll(-(long)list_cur, -(long)list_top);
+}
+
+static void fuzzy_fire(struct timer *t)
+{
+	struct ranking *r = &rank_next;
+	uint64_t deadline = now_ms() + FUZZY_SLICE_MS;
+	if (r->base_gen != filter_gen) {
+		fuzzy_start();
+		return;
+	}
+	do {
+		size_t basec, n;
+		const uint32_t *base = fuzzy_base(&basec);
+		if (r->fromk < r->fromc) {
+			n = r->fromc - r->fromk < FUZZY_CHUNK? r->fromc - r->fromk : FUZZY_CHUNK;
+			fuzzy_run(r, r->from, r->fromk, n);
+			r->fromk += n;
+		} else if (r->next < basec) {
+			n = basec - r->next < FUZZY_CHUNK? basec - r->next : FUZZY_CHUNK;
+			fuzzy_run(r, base, r->next, n);
+			r->next += n;
+		} else {
+			fuzzy_publish();
+			return;
+		}
+	} while (now_ms() < deadline);
+	timer_arm(t, 0);
+}
+static struct timer fuzzy_timer = { 0, fuzzy_fire };
+
+/* fuzzy_extend - ranks the matches which came in since, unless a new
+ *   ranking is under way.  The order is redone if one of them is better than
+ *   the ones in order.
+ */
+static void fuzzy_extend()
+{
+	struct ranking *r = &rank_shown;
+	size_t basec, n = r->n;
+	const uint32_t *base = fuzzy_base(&basec);
+	if (fuzzy_busy) {
+		return;
+	} else if (r->base_gen != filter_gen) {
+		fuzzy_start();
+		return;
+	} else if (r->next == basec) {
+		return;
+	}
+	fuzzy_run(r, base, r->next, basec - r->next);
+	r->next = basec;
+	r->rows = mensure(realloc(r->rows, (r->alloc? r->alloc : 1) * sizeof(uint32_t)));
+	for (size_t i = n; i < r->n; ++i) {
+		r->rows[i] = r->hits[i].match;
+		if (r->sorted && hit_before(&r->hits[i], &r->hits[r->sorted - 1])) {
+			r->sorted = 0;
+			++view_gen;
+		}
+	}
+}
+
+static void fuzzy_stop()
+{
+	ranking_free(&rank_shown);
+	ranking_free(&rank_next);
+	fuzzy_text[0] = '\0';
+	fuzzy_busy = 0;
+	timer_disarm(&fuzzy_timer);
+}
+
+/* view_update - brings the view up to date with the matches */
+static void view_update()
+{
+	size_t n;
+	const uint32_t *base = fuzzy_base(&n);
+	if (fuzzy_text[0]) {
+		fuzzy_extend();
+	}
+	if (rank_shown.text[0]) {
+		view = rank_shown.rows;
+		viewc = rank_shown.n;
+		view_order = fuzzy_order;
+	} else {
+		view = base;
+		viewc = n;
+		view_order = NULL;
+	}
+}
+
+static void filter_changed()
+{
+	size_t at = view_at(), same = 0;
+	while (same < filter_len && same < prompt_len && filter_text[same] == prompt_text[same]) {
+		++same;
+	}
+	filter_drop_other(same);
+	while (filter_len > same) {
+		free(filter_levels[filter_len].rows);
+		memset(&filter_levels[filter_len--], 0, sizeof(struct filter_level));
+	}
+	memcpy(filter_text, prompt_text, prompt_len + 1);
+	while (filter_len < prompt_len) {
+		filter_refine(++filter_len);
+	}
+	++filter_gen;
+	++view_gen;
+	view_update();
+	view_goto(at);
+}
+
+static void filter_closed(int accepted)
+{
+	if (!accepted) {
+		size_t at = view_at();
+		prompt_len = 0;
+		prompt_text[0] = '\0';
+		filter_clear();
+		++view_gen;
+		view_update();
+		view_goto(at);
+	}
+}
+
+/* Changing the order leaves the matches kept by each stage as they are:
+ * the stages are brought up to date with all the matches before, and their
+ * rows are only put in the new order after, each stage walking the rows of
+ * the one before it.  The filter levels kept for the other state of 'X' are
+ * dropped. */
+
+/* view_settle - brings every stage up to date with the matches, ahead of a
+ *   change of the order.
+ */
+static void view_settle()
+{
+	if (regexc) {
+		regex_update(regexc - 1);
+	}
+	for (size_t len = 1; len <= filter_len; ++len) {
+		filter_update(len);
+	}
+	filter_drop_other(0);
+	view_update();
+}
+
+/* stage_reorder - puts rows in the order of in (all the matches if NULL),
+ *   which holds all of them.  mark is zero for every match, and left so.
+ */
+static void stage_reorder(uint32_t *rows, size_t n, const uint32_t *in, size_t inc,
+	uint8_t *mark)
+{
+	size_t k = 0;
+	for (size_t i = 0; i < n; ++i) {
+		mark[rows[i]] = 1;
+	}
+	for (size_t i = 0; i < inc && k < n; ++i) {
+		uint32_t match = in? in[i] : i;
+		if (mark[match]) {
+			mark[match] = 0;
+			rows[k++] = match;
+		}
+	}
+}
+
+/* view_resort - puts the rows of the stages in a new order, once settled */
+static void view_resort(size_t at)
+{
+	uint8_t *mark = mensure(calloc(matchc? matchc : 1, 1));
+	size_t n;
+	const uint32_t *in;
+	scope_valid = 0;
+	in = scope_base(&n);
+	for (int k = 0; k < regexc; ++k) {
+		struct regex_rule *r = &regex_rules[k];
+		stage_reorder(r->rows, r->n, in, n, mark);
+		in = r->rows;
+		n = r->n;
+	}
+	in = regex_base(&n);
+	for (size_t len = 1; len <= filter_len; ++len) {
+		struct filter_level *l = &filter_levels[len];
+		stage_reorder(l->rows, l->n, in, n, mark);
+		in = l->rows;
+		n = l->n;
+	}
+	free(mark);
+	if (fuzzy_busy) {
+		++filter_gen;
+	}
+	++view_gen;
+	view_update();
+	view_goto(at);
+}
+
+/* scope_set - restricts the list to the matches under a node */
+static void scope_set(uint32_t node)
+{
+	size_t at = view_at();
+	scope = node;
+	scope_valid = 0;
+	regex_reset();
+	filter_rebuild();
+	++view_gen;
+	view_update();
+	view_goto(at);
+}
+
+/* sort_refresh - sorts the matches again when due, e.g. once the children
+ *   are done.
+ */
+static void sort_refresh(int done)
+{
+	if (sort_due(done)) {
+		size_t at = view_at();
+		view_settle();
+		sort_build(sort_mode);
+		view_resort(at);
+	}
+}
+
+static void regex_closed(int accepted)
+{
+	size_t at = view_at();
+	if (!accepted) {
+		return;
+	} else if (prompt_len == 0 && regexc) {
+		regex_drop();
+	} else if (prompt_len && regex_add(prompt_text, regex_exclude)) {
+		beep();
+		prompt_open(regex_exclude? '-' : '+', NULL, regex_closed);
+		return;
+	}
+	prompt_len = 0;
+	prompt_text[0] = '\0';
+	regex_off = 0;
+	filter_rebuild();
+	++view_gen;
+	view_update();
+	view_goto(at);
+}
+
+static void fuzzy_changed()
+{
+	size_t at = view_at();
+	if (prompt_len == 0) {
+		fuzzy_stop();
+		++view_gen;
+		view_update();
+		view_goto(at);
+		return;
+	}
+	strcpy(fuzzy_text, prompt_text);
+	fuzzy_start();
+}
+
+static void fuzzy_closed(int accepted)
+{
+	if (!accepted) {
+		prompt_len = 0;
+		prompt_text[0] = '\0';
+		fuzzy_changed();
+	}
+}
+
+/* Search - '/' moves the cursor to the next row whose description contains
+ *   the text typed, as in vim, leaving the list as it is, and 'n' and 'N' go
+ *   on to the next and previous one, wrapping around.  The rows are scanned
+ *   a chunk at a time across the workers from a timer, so that a long list
+ *   never holds up the keys, and a key pressed meanwhile starts over.  The
+ *   main thread takes down the matches of the rows of each chunk for the
+ *   workers, and the search starts over from the same match if the view
+ *   changes in between.
+ */
+#define SEARCH_CHUNK    (1 << 16)
+#define SEARCH_SLICE_MS 8
+#define SEARCH_HEADER   UINT32_MAX
+struct search_job {
+	const char *text;
+	int icase;
+	size_t from, step, len;               /* the k-th row is from + step + k, or - */
+	int backward;
+	size_t origin;                        /* the match on the row from */
+	size_t done;                          /* rows looked at */
+	unsigned gen;                         /* view_gen at the start */
+	uint32_t rows[SEARCH_CHUNK];          /* the matches of the chunk, or SEARCH_HEADER */
+	size_t found[WORKERS_MAX];            /* the first k found by each worker */
+};
+static char search_text[PROMPT_LEN];
+static size_t search_origin;              /* the cursor when '/' was pressed */
+static size_t search_origin_top;
+static struct search_job search_job;
+
+static size_t search_row(const struct search_job *j, size_t k)
+{
+	size_t d = (j->step + k) % j->len;
+	return j->backward? (j->from + j->len - d) % j->len : (j->from + d) % j->len;
+}
+
+static void search_scan(void *arg, int worker, size_t begin, size_t end)
+{
+	struct search_job *j = arg;
+	struct mreader r = MREADER_INIT;
+	for (size_t i = begin; i < end; ++i) {
+		if (j->rows[i] == SEARCH_HEADER) {
+			continue;
+		}
+		const char *d = mreader_at(&r, j->rows[i])->description;
+		if (j->icase? strcasestr(d, j->text) != NULL : strstr(d, j->text) != NULL) {
+			j->found[worker] = j->done + i;
+			break;
+		}
+	}
+	mreader_free(&r);
+}
+
+static void search_start(size_t from, size_t step, int backward);
+
+static void search_fire(struct timer *t)
+{
+	struct search_job *j = &search_job;
+	uint64_t deadline = now_ms() + SEARCH_SLICE_MS;
+	if (j->gen != view_gen) {
+		view_goto(j->origin);
+		search_start(list_cur, j->step, j->backward);
+		return;
+	}
+	do {
+		size_t n = j->len - j->done < SEARCH_CHUNK? j->len - j->done : SEARCH_CHUNK;
+		size_t found = SIZE_MAX;
+		if (n == 0) {
+			beep();
+			return;
+		}
+		for (size_t i = 0; i < n; ++i) {
+			size_t row = search_row(j, j->done + i);
+			j->rows[i] = list_group(row)? SEARCH_HEADER : list_match(row);
+		}
+		for (int w = 0; w < WORKERS_MAX; ++w) {
+			j->found[w] = SIZE_MAX;
+		}
+		parallel_run(n, search_scan, j);
+		for (int w = 0; w < WORKERS_MAX; ++w) {
+			found = j->found[w] < found? j->found[w] : found;
+		}
+		if (found != SIZE_MAX) {
+			list_scroll((long)search_row(j, found) - (long)list_cur, 0);
+			dirty |= DIRTY_LIST;
+			timer_arm(&preview_timer, PREVIEW_DELAY_MS);
+			return;
+		}
+		j->done += n;
+	} while (now_ms() < deadline);
+	timer_arm(t, 0);
+}
+static struct timer search_timer = { 0, search_fire };
+
+/* search_start - looks for the text from a row on, that row itself if step
+ *   is 0.
+ */
+static void search_start(size_t from, size_t step, int backward)
+{
+	struct search_job *j = &search_job;
+	timer_disarm(&search_timer);
+	j->text = search_text;
+	j->icase = 1;
+	for (const char *p = search_text; *p; ++p) {
+		j->icase &= !isupper((unsigned char)*p);
+	}
+	j->len = list_len();
+	if (j->len == 0 || search_text[0] == '\0') {
+		return;
+	} else if (view_order) {
+		view_order(view_len());
+	}
+	j->from = from < j->len? from : 0;
+	j->origin = list_match(j->from);
+	j->step = step;
+	j->backward = backward;
+	j->done = 0;
+	j->gen = view_gen;
+	timer_arm(&search_timer, 0);
+}
+
+static void search_changed()
+{
+	strcpy(search_text, prompt_text);
+	list_scroll((long)search_origin - (long)list_cur, (long)search_origin_top - (long)list_top);
+	dirty |= DIRTY_LIST;
+	search_start(search_origin, 0, 0);
+}
+
+static void search_closed(int accepted)
+{
+	if (!accepted) {
+		timer_disarm(&search_timer);
+		list_scroll((long)search_origin - (long)list_cur,
+			(long)search_origin_top - (long)list_top);
+		dirty |= DIRTY_LIST;
+		timer_arm(&preview_timer, PREVIEW_DELAY_MS);
+	}
+}
+
+static void rerun();
+
+#define ENTER  10
+#define ESCAPE 27
+/* dir_go - shows the entries of a directory, which becomes the scope, with
+ *   the cursor on the first one.
+ */
+static void dir_go(uint32_t node)
+{
+	dir_cur = node;
+	dir_entries_at = SIZE_MAX;
+	scope_set(node);
+	list_cur = list_top = 0;
+	list_scroll(dir_cur != 0, 0);
+	dirty |= DIRTY_LIST | DIRTY_FOOTER;
+}
+
+static void dir_close()
+{
+	dir_on = 0;
+	list_cur = list_top = 0;
+	view_goto(dir_list_match);
+	dirty |= DIRTY_ALL;
+}
+
+/* dir_key - handles a key in the directory view, returns 0 for those which
+ *   work as in the list.
+ */
+static int dir_key(int c)
+{
+	uint32_t node = list_cur < list_len()? dir_entry(list_cur) : DIR_UP, from = dir_cur;
+	switch (c) {
+	case ENTER:
+	case 'l':
+	case KEY_RIGHT:
+		if (node == DIR_UP) {
+			return dir_key('h');
+		} else if (dir_nodes[node].file) {
+			scope_set(node);
+			dir_close();
+			list_scroll(-(long)list_cur, -(long)list_top);
+		} else {
+			dir_go(node);
+		}
+		return 1;
+	case 'h':
+	case KEY_LEFT:
+	case KEY_BACKSPACE:
+	case 127:
+	case '\b':
+		if (dir_cur) {
+			dir_go(dir_nodes[dir_cur].parent);
+			for (size_t row = 0; row < list_len(); ++row) {
+				if (dir_entry(row) == from) {
+					list_scroll((long)row - (long)list_cur, 0);
+				}
+			}
+		}
+		return 1;
+	case 'd':
+	case ESCAPE:
+		dir_close();
+		return 1;
+	case 'j':
+	case 'k':
+	case 'g':
+	case 'G':
+	case 'p':
+	case 'e':
+	case 'r':
+	case 'q':
+	case KEY_DOWN:
+	case KEY_UP:
+	case KEY_NPAGE:
+	case KEY_PPAGE:
+	case KEY_HOME:
+	case KEY_END:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+/* handle_key - handles a key pressed count times in a row */
+static void handle_key(int c, int count)
+{
+	if (!prompt_mark) {
+		timer_disarm(&search_timer);
+	}
+	if (prompt_mark && prompt_key(c, count)) {
+		return;
+	} else if (dir_on && dir_key(c)) {
+		return;
+	}
+	switch (c) {
+	case 'j':
+	case KEY_DOWN:
+		list_scroll(count, 0);
+		break;
+	case 'k':
+	case KEY_UP:
+		list_scroll(-count, 0);
+		break;
+	case KEY_NPAGE:
+		list_scroll((long)count * list_rows, (long)count * list_rows);
+		break;
+	case KEY_PPAGE:
+		list_scroll(-(long)count * list_rows, -(long)count * list_rows);
+		break;
+	case 'g':
+	case KEY_HOME:
+		list_scroll(-(long)list_cur, -(long)list_top);
+		break;
+	case 'G':
+	case KEY_END:
+		read_all = 1;
+		flow_control();
+		list_scroll(list_len(), list_len());
+		break;
+	case '&':
+		prompt_len = strlen(strcpy(prompt_text, filter_text));
+		prompt_open('&', filter_changed, filter_closed);
+		return;
+	case 'i':
+	case 'x':
+		regex_exclude = c == 'x';
+		prompt_len = 0;
+		prompt_text[0] = '\0';
+		prompt_open(regex_exclude? '-' : '+', NULL, regex_closed);
+		return;
+	case 'X': {
+		size_t at = view_at();
+		regex_off = !regex_off;
+		filter_switch();
+		++view_gen;
+		view_update();
+		view_goto(at);
+		return;
+	}
+	case 's': {
+		size_t at = view_at();
+		view_settle();
+		sort_mode = (sort_mode + 1) % SORT_MODES;
+		if (sort_due(1)) {
+			sort_build(sort_mode);
+		}
+		view_resort(at);
+		return;
+	}
+	case 't': {
+		size_t at = view_at();
+		tree_on = !tree_on;
+		view_goto(at);
+		return;
+	}
+	case ' ':
+		if (tree_on && list_cur < list_len()) {
+			list_scroll(tree_fold(tree_group_of[sort_file_of[list_match(list_cur)]] - 1)
+				- list_cur, 0);
+			break;
+		}
+		return;
+	case 'T':
+		if (tree_on) {
+			size_t at = view_at();
+			tree_fold_all();
+			view_goto(at);
+		}
+		return;
+	case 'd':
+		dir_list_match = view_at();
+		dir_started = dir_on = 1;
+		view_update();
+		dir_cur = scope;
+		dir_entries_at = SIZE_MAX;
+		list_cur = list_top = 0;
+		dirty |= DIRTY_ALL;
+		return;
+	case '/':
+		search_origin = list_cur;
+		search_origin_top = list_top;
+		prompt_len = 0;
+		prompt_text[0] = '\0';
+		prompt_open('/', search_changed, search_closed);
+		return;
+	case 'n':
+	case 'N':
+		search_start(list_cur, 1, c == 'N');
+		return;
+	case 'f':
+		prompt_len = strlen(strcpy(prompt_text, fuzzy_text));
+		prompt_open('~', fuzzy_changed, fuzzy_closed);
+		return;
+	case ENTER: {
+		if (list_cur >= list_len()) {
+			return;
+		} else if (list_group(list_cur)) {
+			list_scroll(tree_fold(tree_group_of[sort_file_of[list_match(list_cur)]] - 1)
+				- list_cur, 0);
+			break;
+		}
+		const struct match *entry = match_at(list_match(list_cur));
+		endwin();
+		open_match(entry);
+		preview_release();
+		fcache_drop(entry->filepath);
+		refresh();
+		break;
+	}
+	case 'p':
+		show_preview = !show_preview;
+		layout_view();
+		return;
+	case 'e':
+		show_errors = !show_errors;
+		layout_view();
+		return;
+	case 'r':
+		rerun();
+		return;
+	case ESCAPE:
+	case 'q':
+		reactor_stop();
+		return;
+	default:
+		return;
+	}
+	dirty |= DIRTY_LIST;
+	if (preview_rows) {
+		timer_arm(&preview_timer, PREVIEW_DELAY_MS);
+	}
+}
+
+/* key_repeats - tells whether presses of a key in a row add up, i.e. when
+ *   the keyboard repeats faster than frames are drawn.
+ */
+static int key_repeats(int c)
+{
+	return c == 'j' || c == 'k' || c == KEY_DOWN || c == KEY_UP
+		|| c == KEY_NPAGE || c == KEY_PPAGE;
+}
+
+static void handle_input(int fd, void *arg)
+{
+	int c = getch();
+	while (reactor_running && c != ERR) {
+		int count = 1, next = getch();
+		while (next == c && key_repeats(c)) {
+			++count;
+			next = getch();
+		}
+		handle_key(c, count);
+		c = next;
+	}
+}
+
+/* start_view - shows the screen once the first match has arrived */
+static void start_view()
+{
+	init_curses();
+	reactor_add(STDIN_FILENO, handle_input, NULL);
+	reactor_idle = flush_screen;
+	layout_view();
+}
+
+/* Child output - the search may be split across several children (shards).
+ *   Their outputs are taken as they come, or, with ordered merging, one
+ *   after the other: the children after the head of the merge are left
+ *   waiting on their full rings until all the children before them are done.
+ */
+#define MAX_JOBS 16
+static struct child children[MAX_JOBS];
+static int childc;
+static int child_pty;
+static int merge_ordered, merge_head;
+
+/* Ingestion - the output of each child is read and parsed by a thread of its
+ *   own, which hands the matches over to the main thread in batches through
+ *   a single-producer single-consumer ring: the reader only ever writes the
+ *   head, and the main thread the tail.  A byte on ingest_pipe wakes up the
+ *   main thread, which takes at most INGEST_SLICE_MS at a time so that keys
+ *   are never kept waiting.  The reader only takes the lock of its ring to
+ *   sleep, when the ring is full or reading is paused.
+ */
+#define BATCH_LEN       64
+#define RING_LEN        16
+#define INGEST_SLICE_MS 8
+struct batch {
+	size_t n;
+	int eof;                              /* the last batch of the child */
+	struct spool_rec rec[BATCH_LEN];      /* if spooled */
+	struct match m[BATCH_LEN];            /* otherwise */
+	unsigned short width[BATCH_LEN];      /* of the labels, see label_widths() */
+	unsigned short base[BATCH_LEN];
+};
+struct ring {
+	size_t head, tail;
+	int waiting;                          /* the reader is asleep */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct batch slot[RING_LEN];
+};
+static int ingest_pipe[2] = { -1, -1 };
+static int ingest_woken;                  /* a byte is on ingest_pipe */
+static int stop_pipe[2] = { -1, -1 };     /* readable once the readers are to stop */
+static int ingest_stopping;
+
+static void ingest_wake()
+{
+	if (!__atomic_exchange_n(&ingest_woken, 1, __ATOMIC_SEQ_CST)) {
+		write(ingest_pipe[1], "", 1);
+	}
+}
+
+/* reader_wait - puts the reader to sleep while its ring is full (if it needs
+ *   a slot) or reading is paused.  Returns -1 if the reader is to stop.
+ */
+static int reader_wait(struct child *c, int slot)
+{
+	struct ring *r = c->ring;
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		__atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+		size_t used = r->head - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ingest_stopping, __ATOMIC_SEQ_CST)
+			|| !((slot && used == RING_LEN) || __atomic_load_n(&reading_paused, __ATOMIC_SEQ_CST))) {
+			break;
+		}
+		pthread_cond_wait(&r->cond, &r->lock);
+	}
+	__atomic_store_n(&r->waiting, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&r->lock);
+	return __atomic_load_n(&ingest_stopping, __ATOMIC_SEQ_CST)? -1 : 0;
+}
+
+static void reader_wakeup(struct child *c)
+{
+	if (c->ring && __atomic_load_n(&c->ring->waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&c->ring->lock);
+		pthread_cond_signal(&c->ring->cond);
+		pthread_mutex_unlock(&c->ring->lock);
+	}
+}
+
+/* reader_batch - returns the batch being filled, or NULL to stop */
+static struct batch *reader_batch(struct child *c)
+{
+	if (c->batch == NULL) {
+		if (reader_wait(c, 1) == -1) {
+			return NULL;
+		}
+		c->batch = &c->ring->slot[c->ring->head % RING_LEN];
+		c->batch->n = 0;
+		c->batch->eof = 0;
+	}
+	return c->batch;
+}
+
+static void reader_publish(struct child *c)
+{
+	if (c->batch) {
+		__atomic_store_n(&c->ring->head, c->ring->head + 1, __ATOMIC_RELEASE);
+		c->batch = NULL;
+		ingest_wake();
+	}
+}
+
+static void add_match(struct child *c, const char *s, size_t n)
+{
+	struct batch *b = reader_batch(c);
+	if (b == NULL) {
+		return;
+	}
+	struct match scratch, *m = match_spool? &scratch : &b->m[b->n];
+	if (parse_match(s, n, m) != 0) {
+		return;
+	}
+	int base, width = label_widths(m, &base);
+	b->width[b->n] = width;
+	b->base[b->n] = base;
+	if (match_spool) {
+		b->rec[b->n].off = s - spool_base;
+		b->rec[b->n].len = n;
+	}
+	if (++b->n == BATCH_LEN) {
+		reader_publish(c);
+	}
+}
+
+/* child_room - returns where the next output of the child goes, right after
+ *   its partial line, and how much fits there.  In the spool, the partial
+ *   line is moved to new room first if what the reader claimed is used up.
+ */
+#define SPOOL_CLAIM_LEN (1 << 20)
+static char *child_room(struct child *c, size_t *avail)
+{
+	*avail = CHILD_BUF_LEN - c->len;
+	if (match_spool && (c->line == c->buf || c->line + CHILD_BUF_LEN > c->line_end)) {
+		char *p = spool_claim(SPOOL_CLAIM_LEN);
+		memcpy(p, c->line, c->len);
+		c->line = p;
+		c->line_end = p + SPOOL_CLAIM_LEN;
+	}
+	return c->line + c->len;
+}
+
+/* child_lines - adds the complete lines among the n bytes just appended to
+ *   the line buffer of the child.
+ */
+static void child_lines(struct child *c, size_t n)
+{
+	char *p = c->line, *end = c->line + c->len + n, *nl;
+	while ((nl = memchr(p, '\n', end - p)) != NULL) {
+		if (!c->skip) {
+			add_match(c, p, nl - p);
+		}
+		c->skip = 0;
+		p = nl + 1;
+	}
+	c->len = end - p;
+	if (match_spool) {
+		c->line = p;
+	} else {
+		memmove(c->buf, p, c->len);
+	}
+	if (c->len == CHILD_BUF_LEN) {
+		if (!c->skip) {
+			add_match(c, c->line, c->len);
+		}
+		if (match_spool) {
+			c->line += c->len;                /* recorded, keep it */
+		}
+		c->skip = 1;
+		c->len = 0;
+	}
+}
+
+/* child_reader - the reader thread of a child */
+static void *child_reader(void *arg)
+{
+	struct child *c = arg;
+	struct pollfd pfd[2] = { { c->out, POLLIN, 0 }, { stop_pipe[0], POLLIN, 0 } };
+	while (reader_wait(c, 0) == 0) {
+		size_t avail;
+		char *p = child_room(c, &avail);
+		ssize_t n = match_spool? spool_read(c->out, p, avail) : read(c->out, p, avail);
+		if (n == -1 && errno == EAGAIN) {
+			if (poll(pfd, 2, -1) > 0 && pfd[1].revents) {
+				break;
+			}
+		} else if (n == 0 || (n == -1 && errno != EINTR)) {
+			if (c->len && !c->skip) {
+				add_match(c, c->line, c->len);
+			}
+			c->len = 0;
+			struct batch *b = reader_batch(c);
+			if (b) {
+				b->eof = 1;
+				reader_publish(c);
+			}
+			break;
+		} else if (n > 0) {
+			child_lines(c, n);
+			reader_publish(c);
+		}
+	}
+	return NULL;
+}
+
+/* take_batch - adds the matches of a batch to the store */
+static void take_batch(const struct batch *b)
+{
+	for (size_t k = 0; k < b->n; ++k, ++matchc) {
+		label_count(b->width[k], b->base[k]);
+		if (match_spool) {
+			spool_commit(matchc, &b->rec[k]);
+		} else {
+			*match_new() = b->m[k];
+			if (match_compact) {
+				compact_commit();
+			}
+		}
+	}
+}
+
+/* child_eof - joins the reader of a child whose output has ended */
+static void child_eof(struct child *c)
+{
+	pthread_join(c->reader, NULL);
+	c->reading = 0;
+	close(c->out);
+	c->out = -1;
+}
+
+/* drain_ring - takes the batches of a child.  Those of a child after the
+ *   head of an ordered merge are left in its ring: once the ring is full, its
+ *   reader stops reading, and the child blocks on its pipe until its turn.
+ *   So are those coming once the read-ahead is reached, which is checked
+ *   after every batch.  Returns -1 once out of time.
+ */
+static int drain_ring(struct child *c, uint64_t deadline)
+{
+	struct ring *r = c->ring;
+	int late = 0;
+	if (merge_ordered && c != &children[merge_head]) {
+		return 0;
+	}
+	while (c->out != -1 && !reading_paused
+		&& r->tail != __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+		if (now_ms() >= deadline) {
+			late = -1;
+			break;
+		}
+		const struct batch *b = &r->slot[r->tail % RING_LEN];
+		int eof = b->eof;
+		take_batch(b);
+		__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+		if (eof) {
+			child_eof(c);
+		}
+		if (read_ahead && !read_all) {
+			view_update();
+			flow_control();
+		}
+	}
+	reader_wakeup(c);
+	return late;
+}
+
+/* merge_advance - moves the head of an ordered merge past the children
+ *   whose output has ended.  The rings of the next children are drained as
+ *   ingest_fire() goes on to them.
+ */
+static void merge_advance()
+{
+	while (merge_head < childc && children[merge_head].out == -1) {
+		++merge_head;
+	}
+}
+
+/* flow_control - pauses or resumes reading the children per the read-ahead,
+ *   counted in rows of the list past the screen.  On resuming, the batches
+ *   left in the rings are taken first.
+ */
+static struct timer ingest_timer;
+static void flow_control()
+{
+	size_t len = dir_on? 0 : list_len(), end = list_top + list_rows;
+	int pause = read_ahead && !read_all && len > end && len - end >= read_ahead;
+	if (pause == reading_paused) {
+		return;
+	}
+	__atomic_store_n(&reading_paused, pause, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < childc && !pause; ++i) {
+		reader_wakeup(&children[i]);
+	}
+	if (!pause) {
+		timer_arm(&ingest_timer, 0);
+	}
+	dirty |= DIRTY_FOOTER;
+}
+
+/* child_finished - exits when all the children are done without a match */
+static void child_finished()
+{
+	int status = 1;
+	for (int i = 0; i < childc; ++i) {
+		struct child *c = &children[i];
+		if (c->out != -1 || c->err != -1 || !c->exited) {
+			return;
+		}
+		int s = WEXITSTATUS(c->status);
+		if (s > 1 || (s == 0 && status == 1)) {
+			status = s;
+		}
+	}
+	if (matchc > 0) {
+		sort_refresh(1);
+		return;
+	}
+	cleanup_curses();
+	size_t kept = errlog_count < ERRLOG_LINES? errlog_count : ERRLOG_LINES;
+	if (kept < errlog_count) {
+		fprintf(stderr, "[%zu more lines]\n", errlog_count - kept);
+	}
+	while (kept) {
+		fprintf(stderr, "%s\n", errlog_line(--kept));
+	}
+	if (status == 0) {
+		fprintf(stderr, "Unable to parse matches. (Did you forget to specify the "
+			"'-n' option to grep?)\n");
+	} else if (status == 1) {
+		fprintf(stderr, "No matches.\n");
+	}
+	exit(status);
+}
+
+/* The main thread takes the batches when woken up, and carries on with a
+ * timer whenever it runs out of its slice. */
+static void ingest_fire(struct timer *t)
+{
+	size_t count = matchc, rows = list_len();
+	uint64_t deadline = now_ms() + INGEST_SLICE_MS;
+	int more = 0;
+	for (int i = 0; i < childc && !more; ++i) {
+		more = drain_ring(&children[i], deadline) == -1;
+		if (merge_ordered) {
+			merge_advance();
+		}
+	}
+	if (more) {
+		timer_arm(t, 0);
+	}
+	if (matchc > count) {
+		view_update();
+		sort_refresh(0);
+		if (!curses_active) {
+			start_view();
+		} else if (list_top + list_rows > rows || tree_on || dir_on
+			|| label_column() != label_width) {
+			dirty |= DIRTY_LIST;
+		}
+		dirty |= DIRTY_FOOTER;
+	}
+	flow_control();
+	child_finished();
+}
+static struct timer ingest_timer = { 0, ingest_fire };
+
+static void ingest_ready(int fd, void *arg)
+{
+	char buf[64];
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	__atomic_store_n(&ingest_woken, 0, __ATOMIC_SEQ_CST);
+	ingest_fire(&ingest_timer);
+}
+
+/* The status line and the error pane are refreshed at most every
+ * ERRLOG_REFRESH_MS, however fast the children complain. */
+#define ERRLOG_REFRESH_MS 250
+static void errlog_fire(struct timer *t)
+{
+	dirty |= DIRTY_ERRORS | DIRTY_FOOTER;
+}
+static struct timer errlog_timer = { 0, errlog_fire };
+
+static void child_read_err(int fd, void *arg)
+{
+	struct child *c = arg;
+	int lines = errlog_read(c);
+	if (lines == -1) {
+		reactor_remove(fd);
+		close(fd);
+		c->err = -1;
+		child_finished();
+	} else if (lines > 0 && !errlog_timer.deadline) {
+		timer_arm(&errlog_timer, ERRLOG_REFRESH_MS);
+	}
+}
+
+static void child_reaped(pid_t pid, int status)
+{
+	unreaped_forget(pid);
+	for (int i = 0; i < childc; ++i) {
+		struct child *c = &children[i];
+		if (c->pid == pid && !c->exited) {
+			c->exited = 1;
+			c->status = status;
+			child_finished();
+		}
+	}
+}
+
+/* The exit of a child is reported by its pidfd where available, and by
+ * SIGCHLD otherwise.  Both paths reap children which were cancelled, too. */
+static void child_pidfd_ready(int fd, void *arg)
+{
+	pid_t pid = (pid_t)(intptr_t)arg;
+	int status;
+	if (waitpid(pid, &status, WNOHANG) == pid) {
+		reactor_remove(fd);
+		close(fd);
+		child_reaped(pid, status);
+	}
+}
+
+static void handle_sigchld(int signo)
+{
+	int status;
+	for (size_t i = unreapedc; i-- > 0; ) {
+		pid_t pid = unreaped[i];
+		if (waitpid(pid, &status, WNOHANG) == pid) {
+			child_reaped(pid, status);
+		}
+	}
+}
+
+static void start_children()
+{
+	if (ingest_pipe[0] == -1) {
+		ensure(pipe(ingest_pipe));
+		set_cloexec(ingest_pipe[0], 1);
+		set_cloexec(ingest_pipe[1], 1);
+		reactor_add(ingest_pipe[0], ingest_ready, NULL);
+	}
+	ensure(pipe(stop_pipe));
+	set_cloexec(stop_pipe[0], 1);
+	set_cloexec(stop_pipe[1], 1);
+	ingest_stopping = 0;
+	merge_head = 0;
+	for (int i = 0; i < childc; ++i) {
+		struct child *c = &children[i];
+		spawn_child(c, c->argv, child_pty);
+		if (c->ring == NULL) {
+			c->ring = mensure(calloc(1, sizeof(struct ring)));
+			pthread_mutex_init(&c->ring->lock, NULL);
+			pthread_cond_init(&c->ring->cond, NULL);
+		}
+		c->ring->head = c->ring->tail = 0;
+		c->batch = NULL;
+		if (pthread_create(&c->reader, NULL, child_reader, c) != 0) {
+			endwin();
+			fprintf(stderr, "Error: unable to start a reader thread\n");
+			exit(EXIT_FAILURE);
+		}
+		c->reading = 1;
+		reactor_add(c->err, child_read_err, c);
+		if (c->pidfd != -1) {
+			reactor_add(c->pidfd, child_pidfd_ready, (void *)(intptr_t)c->pid);
+		} else {
+			reactor_signal(SIGCHLD, handle_sigchld);
+		}
+	}
+}
+
+/* cancel_children - kills the process groups of the children right away,
+ *   and stops their readers.  The children are reaped whenever they are done
+ *   dying; nobody waits.
+ */
+static void cancel_children()
+{
+	__atomic_store_n(&ingest_stopping, 1, __ATOMIC_SEQ_CST);
+	if (stop_pipe[1] != -1) {
+		write(stop_pipe[1], "", 1);
+	}
+	for (int i = 0; i < childc; ++i) {
+		struct child *c = &children[i];
+		if (c->pid > 0 && (!c->exited || c->out != -1)) {
+			/* the group does not exist until the child has set it up */
+			if (kill(-c->pid, SIGKILL) == -1) {
+				kill(c->pid, SIGKILL);
+			}
+		}
+		if (c->reading) {
+			pthread_mutex_lock(&c->ring->lock);
+			pthread_cond_signal(&c->ring->cond);
+			pthread_mutex_unlock(&c->ring->lock);
+			pthread_join(c->reader, NULL);
+			c->reading = 0;
+		}
+		if (c->out != -1) {
+			close(c->out);
+			c->out = -1;
+		}
+		if (c->err != -1) {
+			reactor_remove(c->err);
+			close(c->err);
+			c->err = -1;
+		}
+		c->exited = 1;
+	}
+	if (stop_pipe[0] != -1) {
+		close(stop_pipe[0]);
+		close(stop_pipe[1]);
+		stop_pipe[0] = stop_pipe[1] = -1;
+	}
+	timer_disarm(&ingest_timer);
+}
+
+/* rerun - cancels the search in progress and starts it over */
+static void rerun()
+{
+	cancel_children();
+	filter_clear();
+	fuzzy_stop();
+	matches_clear();
+	tree_clear();
+	sort_clear();
+	dir_clear();
+	dir_cur = 0;
+	dir_entries_at = SIZE_MAX;
+	regex_reset();
+	view_update();
+	list_top = list_cur = 0;
+	memset(label_hist, 0, sizeof(label_hist));
+	errlog_count = 0;
+	read_all = reading_paused = 0;
+	prefetch_stop();
+	preview_release();
+	fcache_clear();
+	highlight_clear();
+	start_children();
+	layout_view();
+}
+
+static void handle_sigwinch(int signo)
+{
+	if (curses_active) {
+		dirty |= DIRTY_SIZE;
+	}
+}
+
+static void handle_sigint(int signo)
+{
+	reactor_stop();
+}
+
+static void event_loop()
+{
+	reactor_run();
+	cancel_children();
+	cleanup_curses();
+}
+
+/* Known tools - the options which make them flush their output after every
+ *   line, and print the file name even when given a single file, the short
+ *   and long options taking a value, the syntax of their patterns, and
+ *   whether a directory to search may be split into its entries: rg and ack
+ *   search the paths named explicitly even where they would skip them in a
+ *   directory (hidden or ignored files), so theirs are not.
+ */
+#define PATTERN_FIXED -1
+#define PATTERN_PERL  -2                  /* not highlighted */
+#define PATTERN_RUST  -3                  /* highlighted if POSIX syntax too */
+#define GREP_LONG_VALUES " regexp file max-count after-context before-context context" \
+	" include exclude exclude-from exclude-dir label directories devices binary-files" \
+	" group-separator "
+#define RG_LONG_VALUES " regexp file max-count after-context before-context context" \
+	" glob iglob type type-not type-add type-clear max-depth threads max-filesize" \
+	" encoding engine sort sortr replace ignore-file pre pre-glob path-separator" \
+	" colors context-separator max-columns dfa-size-limit regex-size-limit "
+#define ACK_LONG_VALUES " match max-count after-context before-context context type" \
+	" output ignore-dir noignore-dir ignore-file type-set type-add type-del" \
+	" files-from range-start range-end pager "
+struct tool {
+	const char *name;
+	const char *line_buffered;
+	const char *with_filename;
+	const char *with_value;
+	const char *long_with_value;          /* " name name ... " */
+	int syntax;                           /* regcomp() flags, or PATTERN_* */
+	int split_dir;
+};
+static const struct tool tools[] = {
+	{ "grep",  "--line-buffered", "-H", "ABCDdefmX",     GREP_LONG_VALUES, 0,             1 },
+	{ "egrep", "--line-buffered", "-H", "ABCDdefmX",     GREP_LONG_VALUES, REG_EXTENDED,  1 },
+	{ "fgrep", "--line-buffered", "-H", "ABCDdefmX",     GREP_LONG_VALUES, PATTERN_FIXED, 1 },
+	{ "rg",    "--line-buffered", "-H", "ABCEdefgjMmrTt", RG_LONG_VALUES,  PATTERN_RUST,  0 },
+	{ "ack",   "--flush",         "-H", "ABCgm",         ACK_LONG_VALUES,  PATTERN_PERL,  0 },
+};
+
+static const struct tool *find_tool(const char *program)
+{
+	const char *name = strrchr(program, '/');
+	name = name? name + 1 : program;
+	for (size_t i = 0; i < sizeof(tools) / sizeof(tools[0]); ++i) {
+		if (strcmp(name, tools[i].name) == 0) {
+			return &tools[i];
+		}
+	}
+	return NULL;
+}
+
+/* struct tool_args - what the arguments of a known tool mean to it */
+#define TOOL_PATTERNS_MAX 8
+struct tool_args {
+	const char *patterns[TOOL_PATTERNS_MAX];
+	size_t n;
+	int syntax, icase;
+	int word, line;                       /* -w, -x */
+	int paths;                            /* index of the first path, or 0 if none */
+	int mixed;                            /* options follow the paths */
+};
+
+/* tool_long_value - tells whether a long option takes a value */
+static int tool_long_value(const struct tool *t, const char *name, size_t len)
+{
+	for (const char *p = t->long_with_value; (p = strstr(p, name)) != NULL; p += len) {
+		if (p[-1] == ' ' && p[len] == ' ') {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* tool_parse - reads the arguments of a known tool as it does: the patterns
+ *   are given by -e options, or else by the first operand, and the other
+ *   operands are the paths to search.
+ */
+static void tool_parse(const struct tool *t, char *argv[], struct tool_args *a)
+{
+	int operand = 1, options = 1;         /* the first operand is the pattern */
+	memset(a, 0, sizeof(struct tool_args));
+	a->syntax = t->syntax;
+	for (int i = 1; argv[i]; ++i) {
+		const char *arg = argv[i];
+		if (options && strcmp(arg, "--") == 0) {
+			options = 0;
+		} else if (!options || arg[0] != '-' || arg[1] == '\0') {
+			if (operand) {
+				a->patterns[a->n++] = arg;
+				operand = 0;
+			} else if (!a->paths) {
+				a->paths = i;
+			}
+		} else if (arg[1] == '-') {
+			const char *name = arg + 2, *eq = strchr(name, '=');
+			size_t len = eq? (size_t)(eq - name) : strlen(name);
+			const char *v = eq? eq + 1 : NULL;
+			if (!eq && tool_long_value(t, name, len)) {
+				v = argv[i + 1]? argv[++i] : NULL;
+			}
+			a->mixed |= (a->paths != 0);
+			if ((strncmp(name, "regexp", len) == 0 || strncmp(name, "match", len) == 0)
+				&& len > 1 && v) {
+				if (a->n < TOOL_PATTERNS_MAX) {
+					a->patterns[a->n++] = v;
+				}
+				operand = 0;
+			} else if (strncmp(name, "file", len) == 0 && len == 4) {
+				operand = 0;
+			} else if (strcmp(arg, "--ignore-case") == 0) {
+				a->icase = 1;
+			} else if (strcmp(arg, "--fixed-strings") == 0 || strcmp(arg, "--literal") == 0) {
+				a->syntax = PATTERN_FIXED;
+			} else if (strcmp(arg, "--extended-regexp") == 0) {
+				a->syntax = REG_EXTENDED;
+			} else if (strcmp(arg, "--basic-regexp") == 0) {
+				a->syntax = 0;
+			} else if (strcmp(arg, "--perl-regexp") == 0 || strcmp(arg, "--pcre2") == 0) {
+				a->syntax = PATTERN_PERL;
+			} else if (strcmp(arg, "--word-regexp") == 0) {
+				a->word = 1;
+			} else if (strcmp(arg, "--line-regexp") == 0) {
+				a->line = 1;
+			}
+		} else {
+			a->mixed |= (a->paths != 0);
+			for (const char *p = arg + 1; *p; ++p) {
+				if (strchr(t->with_value, *p)) {
+					const char *v = p[1]? p + 1 : argv[i + 1]? argv[++i] : NULL;
+					if (*p == 'e' && v && a->n < TOOL_PATTERNS_MAX) {
+						a->patterns[a->n++] = v;
+					}
+					operand &= (*p != 'e' && *p != 'f');
+					break;
+				} else if (*p == 'i') {
+					a->icase = 1;
+				} else if (*p == 'E') {
+					a->syntax = REG_EXTENDED;
+				} else if (*p == 'P') {
+					a->syntax = PATTERN_PERL;
+				} else if (*p == 'w') {
+					a->word = 1;
+				} else if (*p == 'x' && strcmp(t->name, "ack") != 0) {
+					a->line = 1;                  /* ack -x reads the files from stdin */
+				} else if (*p == 'G') {
+					a->syntax = 0;
+				} else if (*p == 'F' || *p == 'Q') {
+					a->syntax = PATTERN_FIXED;
+				}
+			}
+		}
+	}
+}
+
+/* highlight_pattern - compiles a pattern of a tool for the highlighting,
+ *   escaping a fixed string into an extended regex, and anchoring it for -w
+ *   or -x.  A pattern with back-references is anchored without a group,
+ *   which would renumber them.
+ */
+#ifdef __APPLE__
+#define WORD_START "[[:<:]]"
+#define WORD_END   "[[:>:]]"
+#else
+#define WORD_START "\\<"
+#define WORD_END   "\\>"
+#endif
+static void highlight_pattern(const char *pattern, const struct tool_args *a)
+{
+	char *re = NULL, *anchored = NULL;
+	int syntax = a->syntax == PATTERN_RUST? REG_EXTENDED : a->syntax;
+	if (syntax == PATTERN_FIXED) {
+		char *p = re = mensure(malloc(2 * strlen(pattern) + 1));
+		for ( ; *pattern; *p++ = *pattern++) {
+			if (strchr(".[]()*+?{}|^$\\", *pattern)) {
+				*p++ = '\\';
+			}
+		}
+		*p = '\0';
+		pattern = re;
+		syntax = REG_EXTENDED;
+	}
+	if (a->word || a->line) {
+		int ere = syntax & REG_EXTENDED, group = 1;
+		for (const char *p = pattern; *p; ++p) {
+			group &= !(p[0] == '\\' && p[1] >= '1' && p[1] <= '9');
+			p += (p[0] == '\\' && p[1]);
+		}
+		asprintf(&anchored, "%s%s%s%s%s", a->line? "^" : WORD_START,
+			!group? "" : ere? "(" : "\\(", pattern,
+			!group? "" : ere? ")" : "\\)", a->line? "$" : WORD_END);
+		pattern = mensure(anchored);
+	}
+	highlight_add(pattern, syntax | (a->icase? REG_ICASE : 0));
+	free(anchored);
+	free(re);
+}
+
+/* pattern_posix - tells whether a Rust regex means the same as a POSIX
+ *   extended one: no escapes but of punctuation, no groups with flags or
+ *   lookarounds, no lazy quantifiers, and plain bracket expressions.
+ */
+static int pattern_posix(const char *p)
+{
+	for ( ; *p; ++p) {
+		if (*p == '\\') {
+			if (p[1] == '\0' || isalnum((unsigned char)p[1])) {
+				return 0;
+			}
+			++p;
+		} else if ((*p == '(' || strchr("*+?}", *p)) && p[1] == '?') {
+			return 0;
+		} else if (*p == '[') {
+			const char *e = p + 1;
+			e += (*e == '^');
+			e += (*e == ']');
+			for ( ; *e && *e != ']'; ++e) {
+				if (*e == '[' && e[1] == ':' && strstr(e, ":]")) {
+					e = strstr(e, ":]") + 1;
+				} else if (*e == '\\' || *e == '[' || (strchr("&-~", *e) && e[1] == *e)) {
+					return 0;
+				}
+			}
+			if (*e == '\0') {
+				return 0;
+			}
+			p = e;
+		}
+	}
+	return 1;
+}
+
+/* highlight_args - compiles the patterns given to a known tool for the
+ *   highlighting.  Those in Perl syntax, or in Rust syntax unless it means
+ *   the same in POSIX, are left out, like those which do not compile, as
+ *   they would not match what the tool matched.
+ */
+static void highlight_args(char *argv[])
+{
+	const struct tool *t = find_tool(argv[0]);
+	struct tool_args a;
+	if (t == NULL) {
+		return;
+	}
+	tool_parse(t, argv, &a);
+	for (size_t k = 0; k < a.n && a.syntax != PATTERN_PERL; ++k) {
+		if (a.syntax != PATTERN_RUST || pattern_posix(a.patterns[k])) {
+			highlight_pattern(a.patterns[k], &a);
+		}
+	}
+}
+
+/* insert_arg - returns a copy of argv with arg inserted after the program */
+static char **insert_arg(char *argv[], const char *arg)
+{
+	size_t argc = 0;
+	while (argv[argc]) {
+		++argc;
+	}
+	char **v = mensure(malloc((argc + 2) * sizeof(char *)));
+	v[0] = argv[0];
+	v[1] = (char *)arg;
+	memcpy(v + 2, argv + 1, argc * sizeof(char *));
+	return v;
+}
+
+/* line_buffered - makes the program flush its output after every line.
+ *   The known tools are given their option to do so; any other program is
+ *   run on a pseudo-terminal instead.
+ */
+static char **line_buffered(char *argv[])
+{
+	const struct tool *t = find_tool(argv[0]);
+	if (t == NULL) {
+		child_pty = 1;
+		return argv;
+	}
+	return insert_arg(argv, t->line_buffered);
+}
+
+static int path_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* list_dir - returns the sorted entries of a directory as paths, or NULL
+ *   if one is a symbolic link: the tools follow those when given as
+ *   operands, but not when they come across them in a directory.
+ */
+static char **list_dir(const char *dir, size_t *count)
+{
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		return NULL;
+	}
+	size_t n = 0, a = 0, len = strlen(dir);
+	const char *sep = (len && dir[len - 1] == '/')? "" : "/";
+	char **v = NULL;
+	for (struct dirent *e; (e = readdir(d)) != NULL; ) {
+		if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+			continue;
+		}
+		if (n == a) {
+			a = a? 2 * a : 32;
+			v = mensure(realloc(v, a * sizeof(char *)));
+		}
+		asprintf(&v[n], "%s%s%s", dir, sep, e->d_name);
+		mensure(v[n++]);
+		struct stat st;
+		if (lstat(v[n - 1], &st) == 0 && S_ISLNK(st.st_mode)) {
+			while (n) {
+				free(v[--n]);
+			}
+			free(v);
+			closedir(d);
+			return NULL;
+		}
+	}
+	closedir(d);
+	qsort(v, n, sizeof(char *), path_cmp);
+	*count = n;
+	return v;
+}
+
+/* shard - splits the search across up to jobs children.
+ *   Only known tools are split: their paths to search are the operands
+ *   after the pattern, read as the tool reads them (see tool_parse()), and
+ *   are partitioned in contiguous runs, so that an ordered merge keeps
+ *   them in the order given.  A search whose options follow the paths is
+ *   not split, since the order does not tell the pattern then.  A single
+ *   directory is split by its entries instead, for the tools which search
+ *   them as they would the directory; these are taken in name order,
+ *   whereas a single run walks the directory in readdir() order, so the
+ *   files may then come out in another order.  The tools are told to print
+ *   the file names, as a shard may be left with a single file.
+ */
+static void shard(char *argv[], int jobs)
+{
+	int argc = 0, first;
+	children[0].argv = argv;
+	childc = 1;
+	if (jobs < 2) {
+		return;
+	}
+	while (argv[argc]) {
+		++argc;
+	}
+	const struct tool *t = find_tool(argv[0]);
+	struct tool_args a;
+	if (t == NULL) {
+		return;
+	}
+	tool_parse(t, argv, &a);
+	if (a.mixed || a.paths == 0) {
+		return;
+	}
+	first = a.paths;
+	struct stat st;
+	size_t npaths = argc - first;
+	char **pathv = argv + first;
+	if (npaths == 1 && t->split_dir && stat(pathv[0], &st) == 0 && S_ISDIR(st.st_mode)) {
+		char **entries = list_dir(pathv[0], &npaths);
+		pathv = entries? entries : pathv;
+		npaths = entries? npaths : 1;
+	}
+	if (jobs > (int)npaths) {
+		jobs = npaths;
+	}
+	if (jobs < 2) {
+		return;
+	}
+	for (childc = 0; childc < jobs; ++childc) {
+		size_t lo = npaths * childc / jobs, hi = npaths * (childc + 1) / jobs;
+		char **v = mensure(malloc((first + 1 + (hi - lo) + 1) * sizeof(char *)));
+		int k = 0;
+		v[k++] = argv[0];
+		v[k++] = (char *)t->with_filename;
+		for (int i = 1; i < first; ++i) {
+			v[k++] = argv[i];
+		}
+		for (size_t i = lo; i < hi; ++i) {
+			v[k++] = pathv[i];
+		}
+		v[k] = NULL;
+		children[childc].argv = v;
+	}
+}
+
+/* parse_size - parses a size in bytes, with an optional k, M or G suffix */
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t n = strtoul(s, &end, 10);
+	switch (*end) {
+	case 'g': case 'G': n <<= 10;         /* fall through */
+	case 'm': case 'M': n <<= 10;         /* fall through */
+	case 'k': case 'K': n <<= 10;
+	}
+	return n;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [ options ] <program> [ args ... ]\n"
+		"Options:\n"
+		"  -t, --pty              run the program on a pseudo-terminal\n"
+		"  -l, --line-buffered    make the program flush its output after every line\n"
+		"  -j, --jobs=N           split the paths to search across N programs\n"
+		"  -o, --ordered          show the output of split searches in path order\n"
+		"  -a, --read-ahead=N     stop reading N matches past the screen until needed\n"
+		"  -m, --max-memory=SIZE  keep at most SIZE bytes (k, M, G) of matches in\n"
+		"                         memory, and the rest in a temporary file\n"
+		"  -c, --compact          keep the matches compressed in memory\n"
+		"  -s, --spool            keep the output in a temporary file, and only the\n"
+		"                         offsets of the matches in memory\n"
+		"  -H, --highlight=REGEX  highlight REGEX (extended) in the matches rather\n"
+		"                         than the pattern given to grep, rg or ack\n",
+		program);
+	exit(2);
+}
+
+/* option_arg - returns the value of the option at argv[*i] if it is the
+ *   given one, i.e. "-x VALUE", "-xVALUE", "--name VALUE" or "--name=VALUE".
+ */
+static const char *option_arg(int argc, char *argv[], int *i, const char *opt,
+	const char *name)
+{
+	const char *a = argv[*i];
+	size_t len = strlen(name);
+	if (strncmp(a, opt, 2) == 0 && a[2] != '\0') {
+		return a + 2;
+	} else if (strncmp(a, name, len) == 0 && a[len] == '=') {
+		return a + len + 1;
+	} else if (strcmp(a, opt) != 0 && strcmp(a, name) != 0) {
+		return NULL;
+	} else if (*i + 1 == argc) {
+		usage(*argv);
+	}
+	return argv[++*i];
+}
+
+/* Program entry point */
+int main(int argc, char *argv[])
+{
+	int i = 1, linebuf = 0, jobs = 1;
+	const char *arg, *highlight = NULL;
+	for ( ; i < argc && argv[i][0] == '-'; ++i) {
+		if (strcmp(argv[i], "--") == 0) {
+			++i;
+			break;
+		} else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--pty") == 0) {
+			child_pty = 1;
+		} else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--line-buffered") == 0) {
+			linebuf = 1;
+		} else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--ordered") == 0) {
+			merge_ordered = 1;
+		} else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--compact") == 0) {
+			match_compact = 1;
+			match_spool = 0;
+		} else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--spool") == 0) {
+			match_spool = 1;
+			match_compact = 0;
+		} else if ((arg = option_arg(argc, argv, &i, "-j", "--jobs")) != NULL) {
+			jobs = atoi(arg);
+			if (jobs < 1 || jobs > MAX_JOBS) {
+				fprintf(stderr, "Error: the number of jobs must be between 1 and %d\n",
+					MAX_JOBS);
+				exit(2);
+			}
+		} else if ((arg = option_arg(argc, argv, &i, "-a", "--read-ahead")) != NULL) {
+			read_ahead = strtoul(arg, NULL, 10);
+		} else if ((arg = option_arg(argc, argv, &i, "-m", "--max-memory")) != NULL) {
+			match_budget = parse_size(arg);
+		} else if ((arg = option_arg(argc, argv, &i, "-H", "--highlight")) != NULL) {
+			highlight = arg;
+		} else {
+			usage(*argv);
+		}
+	}
+	if (i == argc) {
+		usage(*argv);
+	}
+	if (highlight && highlight_add(highlight, REG_EXTENDED) != 0) {
+		fprintf(stderr, "Error: invalid regular expression for --highlight\n");
+		exit(2);
+	} else if (!highlight) {
+		highlight_args(argv + i);
+	}
+	seteditor();
+	if (match_spool) {
+		spool_open();
+	}
+	reactor_signal(SIGINT, handle_sigint);
+	reactor_signal(SIGWINCH, handle_sigwinch);
+	shard(linebuf? line_buffered(argv + i) : argv + i, jobs);
+	start_children();
 	event_loop();
 }
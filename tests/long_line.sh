@@ -0,0 +1,45 @@
+#!/bin/sh
+# long_line.sh - a line longer than the line buffer of a child
+# (CHILD_BUF_LEN) is cut, and the lines after it are shown as they are, in
+# every store (in memory, compact and spooled).
+#
+# Usage: tests/long_line.sh [ path/to/browse ]
+
+BROWSE=${1:-./browse}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+{
+	echo "long.c:1:first"
+	printf 'long.c:2:'
+	awk 'BEGIN { for (i = 0; i < 70000; ++i) printf "x"; print "" }'
+	echo "long.c:3:after long"
+	echo "long.c:4:fourth"
+} > "$dir/long.txt"
+
+# run - shows the file in browse on a pseudo-terminal, and quits
+run()
+{
+	cmd="$BROWSE $1 cat $dir/long.txt"
+	if script --version >/dev/null 2>&1; then
+		(sleep 1; printf q) | COLUMNS=100 LINES=24 TERM=xterm script -qfec "$cmd" /dev/null
+	else
+		(sleep 1; printf q) | COLUMNS=100 LINES=24 TERM=xterm script -q /dev/null sh -c "$cmd"
+	fi
+}
+
+status=0
+for mode in "" -c -s; do
+	out=$(run "$mode" | tr -d '\033')
+	case "$out" in
+	*long.c:*)
+		echo "FAIL browse $mode: raw output shown in a row"
+		status=1 ;;
+	*"after long"*fourth*)
+		echo "ok   browse $mode" ;;
+	*)
+		echo "FAIL browse $mode: the lines after the long one are missing"
+		status=1 ;;
+	esac
+done
+exit $status